@@ -0,0 +1,96 @@
+#include <string.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include <atom.h>
+
+#include "capture.h"
+
+#if CAPTURE_SIZE > 0
+static uint8_t cap_buf[CAPTURE_SIZE];
+static struct cap_hdr cap_hdr={
+    .magic=CAP_MAGIC,
+    .version=CAP_VERSION
+};
+static uint8_t cap_armed;
+static uint32_t cap_last;       //cycle count the previous record is stamped at
+
+void capture_start(void){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    cap_hdr.len=0;
+    cap_hdr.flags=0;
+    cap_last=dwt_read_cycle_counter();
+    cap_armed=1;
+    CRITICAL_END();
+}
+
+void capture_stop(void){
+    cap_armed=0;
+}
+
+/* Interrupts masked; disarms when the record does not fit */
+static int capture_rec(uint8_t tag, const uint8_t *data, uint8_t len, uint16_t dt){
+    if(cap_hdr.len+CAP_REC_HDR+len>CAPTURE_SIZE){
+        cap_hdr.flags|=CAP_FLAG_FULL;
+        cap_armed=0;
+        return 0;
+    }
+    uint8_t *r=cap_buf+cap_hdr.len;
+    r[0]=tag;
+    r[1]=len;
+    r[2]=dt;
+    r[3]=dt>>8;
+    if(len)
+        memcpy(r+CAP_REC_HDR, data, len);
+    cap_hdr.len+=CAP_REC_HDR+len;
+    return 1;
+}
+
+/* Callable from any context, longer pieces become several records */
+void capture_put(uint8_t tag, const uint8_t *data, uint16_t len){
+    CRITICAL_STORE;
+    if(!cap_armed)
+        return;
+    CRITICAL_START();
+    uint32_t per_us=rcc_ahb_frequency/1000000;
+    uint32_t us=(dwt_read_cycle_counter()-cap_last)/per_us;
+    while(cap_armed && us>0xffff){
+        uint32_t ms=us/1000<0xffff?us/1000:0xffff;
+        capture_rec(tag, NULL, 0, ms);
+        us-=ms*1000;
+        cap_last+=ms*1000*per_us;
+    }
+    cap_last+=us*per_us;
+    while(cap_armed && len){
+        uint8_t n=len<255?len:255;
+        capture_rec(tag, data, n, us);
+        data+=n;
+        len-=n;
+        us=0;
+    }
+    CRITICAL_END();
+}
+
+/* Bytes of the dump, header then records, from offset off */
+uint16_t capture_read(uint32_t off, uint8_t *buf, uint16_t len){
+    uint32_t total=sizeof(cap_hdr)+cap_hdr.len;
+    uint16_t done=0;
+    while(done<len && off<total){
+        const uint8_t *src;
+        uint32_t run;
+        if(off<sizeof(cap_hdr)){
+            src=(const uint8_t *)&cap_hdr+off;
+            run=sizeof(cap_hdr)-off;
+        }else{
+            src=cap_buf+off-sizeof(cap_hdr);
+            run=total-off;
+        }
+        if(run>(uint32_t)(len-done))
+            run=len-done;
+        memcpy(buf+done, src, run);
+        done+=run;
+        off+=run;
+    }
+    return done;
+}
+#endif
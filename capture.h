@@ -0,0 +1,55 @@
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Capture of the MIDI traffic crossing the device, for replay on the
+ * host (tools/midireplay.c).
+ *
+ * Armed with the CDC command "C1", records go into a RAM buffer from its
+ * start until it is full; "C0" stops, "CD" sends the capture out of the
+ * CDC data endpoint: a struct cap_hdr, then len bytes of records. Each
+ * record is
+ *
+ *   tag  port in bits 0-3 (0 - USB MIDI endpoints, n - UART n),
+ *        CAP_OUT for traffic leaving the device
+ *   len  bytes that follow, as received or sent in one piece
+ *   dt   16 bit LE, microseconds since the previous record; a record
+ *        with len 0 is a gap with dt in milliseconds
+ *
+ * Timestamps come from the DWT cycle counter, gaps longer than its wrap
+ * (89 s at 48 MHz) come out short. CAPTURE_SIZE 0 compiles it out.
+ */
+#ifndef CAPTURE_SIZE
+#define CAPTURE_SIZE 2048
+#endif
+
+#define CAP_MAGIC "MCAP"
+#define CAP_VERSION 1
+#define CAP_OUT 0x80
+#define CAP_TAG(port, out) ((port)|((out)?CAP_OUT:0))
+#define CAP_REC_HDR 4
+
+#define CAP_FLAG_FULL 1     //records were lost at the end
+
+struct cap_hdr {
+    char magic[4];
+    uint8_t version;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t len;
+} __attribute__((packed));
+
+void capture_start(void);
+void capture_stop(void);
+void capture_put(uint8_t tag, const uint8_t *data, uint16_t len);
+uint16_t capture_read(uint32_t off, uint8_t *buf, uint16_t len);
+
+#if CAPTURE_SIZE > 0
+#define CAPTURE(tag, data, len) capture_put((tag), (data), (len))
+#else
+#define CAPTURE(tag, data, len) ((void)0)
+#endif
+
+#endif
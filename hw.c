@@ -1,8 +1,11 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/cm3/nvic.h>
 #include "hw.h"
+#include "ports.h"
+#include "midi.h"
 
 
 void init_hw(void){
@@ -56,56 +59,34 @@ void init_hw(void){
     */
 }
 
-void usart3_setup(void) {
-    nvic_enable_irq(NVIC_USART3_IRQ);
+/* 31250 8N1 MIDI port, rx_dma as in ports.h */
+void midi_usart_setup(uint32_t usart, uint8_t irq, uint32_t gpio,
+        uint16_t tx_pin, uint16_t rx_pin, uint32_t remap, int rx_dma) {
+    nvic_enable_irq(irq);
 
+    gpio_set_mode(gpio, GPIO_MODE_OUTPUT_50_MHZ,
+            GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, tx_pin);
 
-    gpio_set_mode(GPIOC, GPIO_MODE_OUTPUT_50_MHZ,
-            GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_USART3_PR_TX);
+    gpio_set_mode(gpio, GPIO_MODE_INPUT,
+            GPIO_CNF_INPUT_PULL_UPDOWN, rx_pin);
+    gpio_set(gpio, rx_pin);
 
-    gpio_set_mode(GPIOC, GPIO_MODE_INPUT,
-            GPIO_CNF_INPUT_PULL_UPDOWN, GPIO_USART3_PR_RX);
-    gpio_set(GPIOC, GPIO_USART3_PR_RX);
+    AFIO_MAPR |= remap;
 
-    AFIO_MAPR |= AFIO_MAPR_USART3_REMAP_PARTIAL_REMAP;
+    usart_set_baudrate(usart, MIDI_BAUD);
+    usart_set_databits(usart, 8);
+    usart_set_parity(usart, USART_PARITY_NONE);
+    usart_set_stopbits(usart, USART_STOPBITS_1);
 
-    usart_set_baudrate(USART3, 31250);
-    usart_set_databits(USART3, 8);
-    usart_set_parity(USART3, USART_PARITY_NONE);
-    usart_set_stopbits(USART3, USART_STOPBITS_1);
+    usart_set_flow_control(usart, USART_FLOWCONTROL_NONE);
+    usart_set_mode(usart, USART_MODE_TX_RX);
 
-    usart_set_flow_control(USART3, USART_FLOWCONTROL_NONE);
-    usart_set_mode(USART3, USART_MODE_TX_RX);
-
-    USART_CR1(USART3) |= USART_CR1_RXNEIE;
-    usart_enable(USART3);
-}
-
-void usart2_setup(void) {
-    nvic_enable_irq(NVIC_USART2_IRQ);
-
-    gpio_set_mode(GPIOA, GPIO_MODE_OUTPUT_50_MHZ,
-            GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, GPIO_USART2_TX);
-
-    // Setup GPIO pin GPIO_USART1_RE_RX on GPIO port A for receive.
-    gpio_set_mode(GPIOA, GPIO_MODE_INPUT,
-            GPIO_CNF_INPUT_PULL_UPDOWN, GPIO_USART2_RX);
-    gpio_set(GPIOA, GPIO_USART2_RX);
-
-    // Setup UART parameters. 
-    usart_set_baudrate(USART2, 31250);
-    usart_set_databits(USART2, 8);
-    usart_set_parity(USART2, USART_PARITY_NONE);
-    usart_set_stopbits(USART2, USART_STOPBITS_1);
-
-    usart_set_flow_control(USART2, USART_FLOWCONTROL_NONE);
-    usart_set_mode(USART2, USART_MODE_TX_RX);
-
-    /* Enable USART1 Receive interrupt. */
-    USART_CR1(USART2) |= USART_CR1_RXNEIE;
-
-    /* Finally enable the USART. */
-    usart_enable(USART2);
+    /* With receive DMA only idle line needs an interrupt, else every byte */
+    if(rx_dma)
+        USART_CR1(usart) |= USART_CR1_IDLEIE;
+    else
+        USART_CR1(usart) |= USART_CR1_RXNEIE;
+    usart_enable(usart);
 }
 
 void usart1_setup(void) {
@@ -137,10 +118,55 @@ void usart1_setup(void) {
     usart_enable(USART1);
 }
 
+/*
+ * Circular peripheral-to-memory transfer of everything the USART receives.
+ * Consumer follows the write position through CNDTR.
+ */
+void usart_rx_dma_setup(uint32_t usart, uint8_t channel, uint8_t irq,
+        uint8_t *buf, uint16_t len) {
+    dma_channel_reset(DMA1, channel);
+    dma_set_peripheral_address(DMA1, channel, (uint32_t)&USART_DR(usart));
+    dma_set_memory_address(DMA1, channel, (uint32_t)buf);
+    dma_set_number_of_data(DMA1, channel, len);
+    dma_set_read_from_peripheral(DMA1, channel);
+    dma_enable_memory_increment_mode(DMA1, channel);
+    dma_set_peripheral_size(DMA1, channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(DMA1, channel, DMA_CCR_PL_HIGH);
+    dma_enable_circular_mode(DMA1, channel);
+    dma_enable_half_transfer_interrupt(DMA1, channel);
+    dma_enable_transfer_complete_interrupt(DMA1, channel);
+
+    nvic_enable_irq(irq);
+    dma_enable_channel(DMA1, channel);
+    usart_enable_rx_dma(usart);
+}
+
+/*
+ * Memory-to-peripheral transfer, armed per run by the transmit ring;
+ * only the transfer complete interrupt is used.
+ */
+void usart_tx_dma_setup(uint32_t usart, uint8_t channel, uint8_t irq) {
+    dma_channel_reset(DMA1, channel);
+    dma_set_peripheral_address(DMA1, channel, (uint32_t)&USART_DR(usart));
+    dma_set_read_from_memory(DMA1, channel);
+    dma_enable_memory_increment_mode(DMA1, channel);
+    dma_set_peripheral_size(DMA1, channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(DMA1, channel, DMA_CCR_PL_MEDIUM);
+    dma_enable_transfer_complete_interrupt(DMA1, channel);
+
+    nvic_enable_irq(irq);
+    usart_enable_tx_dma(usart);
+}
+
+#define MIDI_PORT_USART_SETUP(cable, n, tx_size, rx_size, rx_dma) \
+    midi_usart_setup(UART##n##_USART, UART##n##_IRQ, UART##n##_GPIO, \
+            UART##n##_TX_PIN, UART##n##_RX_PIN, UART##n##_REMAP, rx_dma);
+
 void usart_setup(void) {
     usart1_setup();
-    usart2_setup();
-    usart3_setup();
+    MIDI_PORTS(MIDI_PORT_USART_SETUP)
 }
 
 
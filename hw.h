@@ -1,11 +1,54 @@
 #ifndef HW_H_INCLUDED
 #define HW_H_INCLUDED
 
+#include <stdint.h>
+
+/*
+ * USART wiring, UART<n>_*: pins, activity LED on GPIOC and the DMA1
+ * channels the reference manual assigns to the USART. Ports in ports.h
+ * refer to these by n.
+ */
+#define UART1_USART     USART1
+#define UART1_TX_DMA    4
+
+#define UART2_USART     USART2
+#define UART2_IRQ       NVIC_USART2_IRQ
+#define UART2_RCC       RCC_USART2
+#define UART2_GPIO      GPIOA
+#define UART2_TX_PIN    GPIO_USART2_TX
+#define UART2_RX_PIN    GPIO_USART2_RX
+#define UART2_REMAP     0
+#define UART2_TX_DMA    7
+#define UART2_RX_DMA    6
+#define UART2_LED       GPIO9
+
+#define UART3_USART     USART3
+#define UART3_IRQ       NVIC_USART3_IRQ
+#define UART3_RCC       RCC_USART3
+#define UART3_GPIO      GPIOC
+#define UART3_TX_PIN    GPIO_USART3_PR_TX
+#define UART3_RX_PIN    GPIO_USART3_PR_RX
+#define UART3_REMAP     AFIO_MAPR_USART3_REMAP_PARTIAL_REMAP
+#define UART3_TX_DMA    2
+#define UART3_RX_DMA    3
+#define UART3_LED       GPIO8
+
+/* DMA1 channel number to channel id, IRQ and ISR name */
+#define DMA_CH(ch)      DMA_CH_(ch)
+#define DMA_CH_(ch)     DMA_CHANNEL##ch
+#define DMA_CH_IRQ(ch)  DMA_CH_IRQ_(ch)
+#define DMA_CH_IRQ_(ch) NVIC_DMA1_CHANNEL##ch##_IRQ
+#define DMA_CH_ISR(ch)  DMA_CH_ISR_(ch)
+#define DMA_CH_ISR_(ch) dma1_channel##ch##_isr
+
 void init_hw(void);
 void usart_setup(void);
-void usart3_setup(void);
-void usart2_setup(void);
 void usart1_setup(void);
+void midi_usart_setup(uint32_t usart, uint8_t irq, uint32_t gpio,
+        uint16_t tx_pin, uint16_t rx_pin, uint32_t remap, int rx_dma);
+void usart_rx_dma_setup(uint32_t usart, uint8_t channel, uint8_t irq,
+        uint8_t *buf, uint16_t len);
+void usart_tx_dma_setup(uint32_t usart, uint8_t channel, uint8_t irq);
 
 
 #endif
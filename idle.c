@@ -0,0 +1,87 @@
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/rcc.h>
+#include <atom.h>
+#include <atomtimer.h>
+
+#include "cortexm3_macro.h"
+#include "idle.h"
+
+struct idle_stats idle_stats;
+uint32_t idle_tick_cycles;
+static uint32_t idle_max_ticks; //longest sleep the 24 bit reload can time
+
+void idle_tick_setup(void){
+    idle_tick_cycles=rcc_ahb_frequency/SYSTEM_TICKS_PER_SEC;
+    idle_max_ticks=(STK_RVR_RELOAD+1)/idle_tick_cycles;
+    systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
+    systick_set_reload(idle_tick_cycles-1);
+    systick_clear();
+    systick_interrupt_enable();
+    systick_counter_enable();
+}
+
+/* Plain WFI, woken by the next tick at the latest */
+static void idle_wfi(void){
+    (void)systick_get_countflag();
+    uint32_t v0=systick_get_value();
+    __WFI();
+    uint32_t v1=systick_get_value();
+    idle_stats.sleep_cycles+=v0-v1+(systick_get_countflag()?idle_tick_cycles:0);
+}
+
+/*
+ * Caller masks interrupts. The tick in progress ends after the current
+ * count, the stretched reload adds ticks-1 whole ticks to it; wrapping
+ * to zero raises the usual SysTick interrupt for the last of them. An
+ * earlier wakeup keeps the phase: SysTick restarts with what is left of
+ * the tick in progress. The few cycles the counter is stopped for are
+ * lost to the system time.
+ */
+void idle_sleep(uint32_t ticks){
+    idle_stats.sleeps++;
+    if(ticks==0 || ticks>idle_max_ticks)
+        ticks=idle_max_ticks;
+    if(ticks<2 || (SCB_ICSR&SCB_ICSR_PENDSTSET)){
+        idle_wfi();
+        return;
+    }
+
+    systick_counter_disable();
+    uint32_t load=systick_get_value()+(ticks-1)*idle_tick_cycles;
+    systick_set_reload(load);
+    systick_clear();
+    systick_counter_enable();
+    __WFI();
+    systick_counter_disable();
+    uint32_t now=systick_get_value();
+
+    uint32_t passed, left;
+    if(systick_get_countflag()){
+        /* ran to the deadline, counting again since the wrap */
+        uint32_t since=load-now;
+        passed=ticks-1;
+        left=since<idle_tick_cycles?idle_tick_cycles-since:1;
+        idle_stats.sleep_cycles+=load+1+since;
+    }else{
+        /* tick boundaries lie at multiples of idle_tick_cycles */
+        uint32_t q=(now-1)/idle_tick_cycles;
+        passed=q<ticks-1?ticks-1-q:0;
+        left=now-q*idle_tick_cycles;
+        idle_stats.sleep_cycles+=load-now;
+    }
+    systick_set_reload(left);
+    systick_clear();
+    systick_counter_enable();
+    systick_set_reload(idle_tick_cycles-1);
+
+    idle_stats.tickless++;
+    idle_stats.ticks_skipped+=passed;
+    if(passed){
+        /* as sys_tick_handler does, timers that expire wake their threads */
+        atomIntEnter();
+        while(passed--)
+            atomTimerTick();
+        atomIntExit(TRUE);
+    }
+}
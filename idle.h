@@ -0,0 +1,33 @@
+#ifndef IDLE_H_INCLUDED
+#define IDLE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Idle sleep with tick suppression.
+ *
+ * The lowest priority thread calls idle_sleep() with interrupts masked:
+ * the core waits in WFI until an interrupt is pending and takes it once
+ * the caller unmasks. Allowed to sleep longer than a tick, SysTick is
+ * reloaded to fire only at that deadline and the ticks slept through are
+ * handed to the kernel timers on wakeup, so an idle bus costs no tick
+ * interrupts at all.
+ *
+ * Power follows the share of sleep_cycles in the time run,
+ * atomTimeGet() ticks of idle_tick_cycles each.
+ */
+struct idle_stats {
+    uint32_t sleeps;        //WFI entered
+    uint32_t tickless;      //of them with SysTick stretched
+    uint32_t ticks_skipped; //tick interrupts saved
+    uint64_t sleep_cycles;  //core clocks spent in WFI
+};
+extern struct idle_stats idle_stats;
+extern uint32_t idle_tick_cycles;
+
+/* SysTick at SYSTEM_TICKS_PER_SEC from the core clock */
+void idle_tick_setup(void);
+/* Sleep at most ticks system ticks, 0 - as long as SysTick allows */
+void idle_sleep(uint32_t ticks);
+
+#endif
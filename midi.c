@@ -0,0 +1,151 @@
+#include "midi.h"
+
+#define ST(len, cin, flags) ((len) | ((cin)<<MIDI_CIN_SHIFT) | (flags) | MIDI_STATUS)
+
+const uint16_t midi_class_table[256]={
+    /* 0x00..0x7f data bytes are all zero */
+    [0x80 ... 0x8f]=ST(3, 0x8, 0),              //Note off
+    [0x90 ... 0x9f]=ST(3, 0x9, 0),              //Note on
+    [0xa0 ... 0xaf]=ST(3, 0xa, 0),              //Poly aftertouch
+    [0xb0 ... 0xbf]=ST(3, 0xb, 0),              //CC
+    [0xc0 ... 0xcf]=ST(2, 0xc, 0),              //Program
+    [0xd0 ... 0xdf]=ST(2, 0xd, 0),              //Chan aftertouch
+    [0xe0 ... 0xef]=ST(3, 0xe, 0),              //Pitch wheel
+    [0xf0]=ST(0, 0x4, MIDI_SX_START),           //sysex start
+    [0xf1]=ST(2, 0x2, 0),                       //Quarter frame MTC
+    [0xf2]=ST(3, 0x3, 0),                       //Song pointer
+    [0xf3]=ST(2, 0x2, 0),                       //Song select
+    [0xf4]=ST(0, 0x0, MIDI_UNDEF),
+    [0xf5]=ST(0, 0x0, MIDI_UNDEF),
+    [0xf6]=ST(1, 0x5, 0),                       //Tune request
+    [0xf7]=ST(0, 0x5, MIDI_SX_END),             //sysex stop
+    [0xf8]=ST(1, 0xf, MIDI_RT),                 //timing clock
+    [0xf9]=ST(0, 0x0, MIDI_RT|MIDI_UNDEF),
+    [0xfa]=ST(1, 0xf, MIDI_RT),                 //start
+    [0xfb]=ST(1, 0xf, MIDI_RT),                 //continue
+    [0xfc]=ST(1, 0xf, MIDI_RT),                 //stop
+    [0xfd]=ST(0, 0x0, MIDI_RT|MIDI_UNDEF),
+    [0xfe]=ST(1, 0xf, MIDI_RT),                 //active sense
+    [0xff]=ST(1, 0xf, MIDI_RT),                 //reset
+};
+
+/* USB-MIDI 1.0 table 4-1; CIN 0 and 1 are reserved */
+const uint8_t midi_cin_len[16]={
+    0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1
+};
+
+/* Returns 1 when the byte completed an event, stored in *ev */
+static inline int midi_parse_byte(struct midi_parser *mp, uint8_t data, uint32_t *ev){
+    uint16_t c=midi_class(data);
+
+    if(c&MIDI_RT){
+        if(c&MIDI_UNDEF)
+            return 0;
+        *ev=midi_cin(c) | (uint32_t)data<<8;
+        return 1;
+    }
+
+    if(!(c&MIDI_STATUS)){
+        if(mp->rp==0) //no status to go with it
+            return 0;
+        mp->recv.u8[mp->rp++]=data;
+        if(mp->rp<mp->expected)
+            return 0;
+        *ev=mp->recv.u32;
+        if(mp->sysex){
+            mp->recv.u8[0]=0x04;
+            mp->rp=1;
+        }else if(mp->recv.u8[1]>=0xf0){
+            mp->rp=0; //no running status for system common
+        }else{
+            mp->rp=2;
+        }
+        return 1;
+    }
+
+    switch(c&MIDI_SX_MASK){
+        case MIDI_SX_START:
+            mp->recv.u8[0]=0x04;
+            mp->recv.u8[1]=data;
+            mp->expected=4;
+            mp->rp=2;
+            mp->sysex=1;
+            return 0;
+        case MIDI_SX_END:
+            if(!mp->sysex){
+                mp->rp=0;
+                return 0;
+            }
+            //0xf7 takes the next free byte, CIN 5..7 tells how many
+            mp->recv.u8[0]=midi_cin(c)+mp->rp-1;
+            mp->recv.u8[mp->rp]=data;
+            while(++mp->rp<4)
+                mp->recv.u8[mp->rp]=0;
+            *ev=mp->recv.u32;
+            mp->sysex=0;
+            mp->rp=0;
+            return 1;
+    }
+
+    //any other status ends an unterminated sysex
+    mp->sysex=0;
+    if(midi_len(c)==0){ //undefined status
+        mp->rp=0;
+        return 0;
+    }
+    mp->recv.u8[0]=midi_cin(c);
+    mp->recv.u8[1]=data;
+    mp->recv.u8[2]=0;
+    mp->recv.u8[3]=0;
+    mp->expected=midi_len(c)+1;
+    mp->rp=2;
+    if(mp->expected==2){ //tune request
+        *ev=mp->recv.u32;
+        mp->rp=0;
+        return 1;
+    }
+    return 0;
+}
+
+uint16_t midi_parse(struct midi_parser *mp, const uint8_t *in, uint16_t len,
+        uint32_t *out, uint16_t max, uint16_t *events){
+    uint16_t i=0;
+    uint16_t n=0;
+    //a byte completes at most one event
+    while(i<len && n<max){
+        if(midi_parse_byte(mp, in[i++], out+n))
+            out[n++]|=(uint32_t)mp->cable<<4;
+    }
+    *events=n;
+    return i;
+}
+
+uint16_t midi_parse_stamped(struct midi_parser *mp, const uint8_t *in, uint16_t len,
+        uint32_t t, uint32_t dt, uint32_t *out, uint32_t *stamps, uint16_t max,
+        uint16_t *events){
+    uint16_t i=0;
+    uint16_t n=0;
+    while(i<len && n<max){
+        uint8_t data=in[i++];
+        uint16_t c=midi_class(data);
+        //a status starts the next event, except 0xf7 ending the one open
+        if(!(c&MIDI_RT) && (!mp->open ||
+                    ((c&MIDI_STATUS) && (c&MIDI_SX_MASK)!=MIDI_SX_END))){
+            mp->stamp=t;
+            mp->open=1;
+        }
+        if(midi_parse_byte(mp, data, out+n)){
+            out[n]|=(uint32_t)mp->cable<<4;
+            if(c&MIDI_RT){
+                stamps[n]=t;
+            }else{
+                stamps[n]=mp->stamp;
+                mp->open=0;
+            }
+            n++;
+        }
+        t+=dt;
+    }
+    *events=n;
+    return i;
+}
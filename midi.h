@@ -0,0 +1,93 @@
+#ifndef MIDI_H_INCLUDED
+#define MIDI_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * MIDI 1.0 byte classifier. One lookup per byte gives everything the
+ * UART parser needs to frame a USB-MIDI event:
+ *
+ *  bits 0-1   message length in bytes including status (1..3), 0 for
+ *             data bytes, sysex start/end and undefined statuses
+ *  bit  2     system realtime (0xf8..0xff)
+ *  bits 3-4   sysex role
+ *  bit  5     status byte
+ *  bit  6     undefined status, to be ignored
+ *  bits 8-11  USB-MIDI Code Index Number; sysex end holds the CIN for
+ *             a lone 0xf7, add the number of bytes before it
+ */
+#define MIDI_LEN_MASK   0x0003
+#define MIDI_RT         0x0004
+#define MIDI_SX_MASK    0x0018
+#define MIDI_SX_NONE    0x0000
+#define MIDI_SX_START   0x0008
+#define MIDI_SX_END     0x0010
+#define MIDI_STATUS     0x0020
+#define MIDI_UNDEF      0x0040
+#define MIDI_CIN_SHIFT  8
+
+#define MIDI_BAUD       31250
+#define MIDI_BYTE_BITS  10      //8N1 with start and stop bits
+
+extern const uint16_t midi_class_table[256];
+extern const uint8_t midi_cin_len[16];
+
+static inline uint16_t midi_class(uint8_t b){
+    return midi_class_table[b];
+}
+
+static inline uint8_t midi_len(uint16_t c){
+    return c&MIDI_LEN_MASK;
+}
+
+static inline uint8_t midi_cin(uint16_t c){
+    return (c>>MIDI_CIN_SHIFT)&0x0f;
+}
+
+/* Number of MIDI bytes carried by a USB-MIDI event with this CIN */
+static inline uint8_t midi_cin_bytes(uint8_t cin){
+    return midi_cin_len[cin&0x0f];
+}
+
+/*
+ * MIDI byte stream to USB-MIDI event framing, one parser per input port.
+ *
+ * recv holds the event being built, rp is the next byte to fill and
+ * expected the event size with the USB header. After a channel message
+ * rp stays at 2 for running status, inside sysex it goes back to 1.
+ * Realtime bytes may appear anywhere in the stream: they come out as
+ * their own event and leave recv alone. Every event is tagged with cable.
+ * stamp is the time of the first byte of the event in recv, open tells
+ * whether one has started (midi_parse_stamped only).
+ */
+struct midi_parser {
+    union {
+        uint8_t u8[4];
+        uint32_t u32;
+    } recv;
+    uint32_t stamp;
+    uint8_t cable;
+    uint8_t rp;
+    uint8_t expected;
+    uint8_t sysex;
+    uint8_t open;
+};
+
+/*
+ * Parse up to len bytes from in, storing at most max events in out.
+ * Returns the number of bytes consumed, which is less than len only when
+ * out filled up; *events gets the number of events stored.
+ */
+uint16_t midi_parse(struct midi_parser *mp, const uint8_t *in, uint16_t len,
+        uint32_t *out, uint16_t max, uint16_t *events);
+
+/*
+ * midi_parse that also stores in stamps the time of each event's first
+ * byte, which may lie in an earlier call. in[0] arrived at t, every next
+ * byte dt later; the unit is the caller's.
+ */
+uint16_t midi_parse_stamped(struct midi_parser *mp, const uint8_t *in, uint16_t len,
+        uint32_t t, uint32_t dt, uint32_t *out, uint32_t *stamps, uint16_t max,
+        uint16_t *events);
+
+#endif
@@ -0,0 +1,42 @@
+#include <atom.h>
+
+#include "pktpool.h"
+
+static struct pkt pkt_blocks[PKT_POOL_BLOCKS];
+static uint8_t pkt_free_stack[PKT_POOL_BLOCKS];
+struct pkt_pool_stats pkt_pool_stats;
+
+void pkt_pool_init(void){
+    uint8_t i;
+    for(i=0;i<PKT_POOL_BLOCKS;i++)
+        pkt_free_stack[i]=i;
+    pkt_pool_stats.free=PKT_POOL_BLOCKS;
+    pkt_pool_stats.max_used=0;
+    pkt_pool_stats.alloc_fail=0;
+}
+
+struct pkt *pkt_alloc(void){
+    CRITICAL_STORE;
+    struct pkt *p=NULL;
+    CRITICAL_START();
+    if(pkt_pool_stats.free){
+        p=&pkt_blocks[pkt_free_stack[--pkt_pool_stats.free]];
+        if(PKT_POOL_BLOCKS-pkt_pool_stats.free>pkt_pool_stats.max_used)
+            pkt_pool_stats.max_used=PKT_POOL_BLOCKS-pkt_pool_stats.free;
+    }else{
+        pkt_pool_stats.alloc_fail++;
+    }
+    CRITICAL_END();
+    return p;
+}
+
+void pkt_free(struct pkt *p){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    pkt_free_stack[pkt_pool_stats.free++]=p-pkt_blocks;
+    CRITICAL_END();
+}
+
+uint8_t pkt_pool_free(void){
+    return pkt_pool_stats.free;
+}
@@ -0,0 +1,42 @@
+#ifndef PKTPOOL_H_INCLUDED
+#define PKTPOOL_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Fixed-block pool of USB packet buffers shared by the USB and UART
+ * pipelines. Allocation and release are O(1) and safe from ISRs and
+ * threads alike.
+ *
+ * A block has exactly one owner at a time: whoever allocated it, until
+ * the pointer is passed on through a queue (usb_out_queue, the USB IN
+ * transmit queue); the receiving side frees it.
+ *
+ * USB IN blocks carry the arrival time of each event next to it: stamp[i]
+ * goes with data[4*i], see tstamp.h. Other blocks leave it alone.
+ */
+#define PKT_SIZE 64
+
+#ifndef PKT_POOL_BLOCKS
+#define PKT_POOL_BLOCKS 8
+#endif
+
+struct pkt {
+    uint8_t len;
+    uint8_t data[PKT_SIZE] __attribute__((aligned(4))); //holds 32-bit events
+    uint32_t stamp[PKT_SIZE/4];
+};
+
+struct pkt_pool_stats {
+    uint8_t free;
+    uint8_t max_used;       //high-water mark of blocks in use
+    uint32_t alloc_fail;
+};
+
+void pkt_pool_init(void);
+struct pkt *pkt_alloc(void);
+void pkt_free(struct pkt *p);
+uint8_t pkt_pool_free(void);
+extern struct pkt_pool_stats pkt_pool_stats;
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PORTS_H_INCLUDED
+#define PORTS_H_INCLUDED
+
+/*
+ * MIDI ports, X(cable, uart, tx_size, rx_size, rx_dma). Each port is one
+ * USB-MIDI cable both ways: events received on the UART go to the host
+ * tagged with the cable, and by default the cable is routed back out of
+ * the same UART. Cables are numbered from 0 without gaps. tx_size is the
+ * transmit ring (power of two). rx_dma is 1 to receive through a circular
+ * DMA buffer of rx_size bytes drained on half/full transfer and idle
+ * line, 0 for one RXNE interrupt per byte, rx_size then unused. The UART
+ * wiring comes from the UART<n>_* definitions in hw.h.
+ *
+ * Everything per port is generated from this list: USART setup, ISRs,
+ * rings, parser state, USB jack descriptors and default routing.
+ */
+#define MIDI_PORTS(X) \
+    X(0, 2, 256, 64, 1) \
+    X(1, 3,  64, 64, 1)
+
+/* MIDI_CABLE_UART<n>: cable of the port on uart n */
+#define MIDI_PORT_CABLE_X(cable, uart, tx_size, rx_size, rx_dma) MIDI_CABLE_UART##uart=(cable),
+enum { MIDI_PORTS(MIDI_PORT_CABLE_X) };
+
+#define MIDI_PORT_INDEX_X(cable, uart, tx_size, rx_size, rx_dma) MIDI_PORT_INDEX_UART##uart,
+enum { MIDI_PORTS(MIDI_PORT_INDEX_X) MIDI_PORT_COUNT };
+
+#define MIDI_PORT_CHECK_X(cable, uart, tx_size, rx_size, rx_dma) \
+    _Static_assert((cable)<MIDI_PORT_COUNT, "MIDI_PORTS cables must be 0..n-1");
+MIDI_PORTS(MIDI_PORT_CHECK_X)
+/* rx_dma is pasted onto macro names, so a literal 0 or 1 */
+#define MIDI_PORT_RX_DMA_0 0
+#define MIDI_PORT_RX_DMA_1 1
+#define MIDI_PORT_RX_DMA_X(cable, uart, tx_size, rx_size, rx_dma) \
+    _Static_assert(MIDI_PORT_RX_DMA_##rx_dma==(rx_dma), "MIDI_PORTS rx_dma must be 0 or 1");
+MIDI_PORTS(MIDI_PORT_RX_DMA_X)
+#define MIDI_PORT_CABLE_BIT_X(cable, uart, tx_size, rx_size, rx_dma) |1u<<(cable)
+_Static_assert((0 MIDI_PORTS(MIDI_PORT_CABLE_BIT_X))==(1u<<MIDI_PORT_COUNT)-1,
+        "MIDI_PORTS cables must be unique");
+
+#endif
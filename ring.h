@@ -0,0 +1,117 @@
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Lock-free single producer / single consumer byte ring.
+ *
+ * Size must be a power of two (up to 32768). head and tail run freely and
+ * wrap at 16 bits, so head-tail is always the fill level and the whole
+ * storage is usable. Only the producer stores head, only the consumer
+ * stores tail; each side publishes with release and reads the other side
+ * with acquire, so the data copy is visible before the index moves.
+ *
+ * Both sides work on contiguous spans: reserve/commit for the producer,
+ * peek/consume for the consumer. A span ends at the end of storage, the
+ * rest (if any) is returned by the next call.
+ */
+struct ring {
+    uint8_t *buf;
+    uint16_t mask;
+    uint16_t head;
+    uint16_t tail;
+};
+
+#define RING_INIT(storage) { \
+    .buf=(storage), \
+    .mask=sizeof(storage)-1, \
+    .head=0, \
+    .tail=0 \
+}
+
+#define RING_SIZE_OK(size) ((size)!=0 && ((size)&((size)-1))==0 && (size)<=32768)
+
+static inline void ring_init(struct ring *r, uint8_t *buf, uint16_t size){
+    r->buf=buf;
+    r->mask=size-1;
+    r->head=0;
+    r->tail=0;
+}
+
+static inline uint16_t ring_used(const struct ring *r){
+    return (uint16_t)(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+            __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+}
+
+static inline uint16_t ring_free(const struct ring *r){
+    return (uint16_t)(r->mask+1-ring_used(r));
+}
+
+/* Producer: contiguous free space at head, *p points to its start */
+static inline uint16_t ring_reserve(struct ring *r, uint8_t **p){
+    uint16_t head=r->head;
+    uint16_t tail=__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    uint16_t free=(uint16_t)(r->mask+1-(uint16_t)(head-tail));
+    uint16_t off=head&r->mask;
+    uint16_t run=r->mask+1-off;
+    *p=r->buf+off;
+    return run<free?run:free;
+}
+
+/* Producer: publish n bytes written into the reserved span */
+static inline void ring_commit(struct ring *r, uint16_t n){
+    __atomic_store_n(&r->head, (uint16_t)(r->head+n), __ATOMIC_RELEASE);
+}
+
+/* Consumer: contiguous filled span at tail, *p points to its start */
+static inline uint16_t ring_peek(struct ring *r, uint8_t **p){
+    uint16_t tail=r->tail;
+    uint16_t used=(uint16_t)(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE)-tail);
+    uint16_t off=tail&r->mask;
+    uint16_t run=r->mask+1-off;
+    *p=r->buf+off;
+    return run<used?run:used;
+}
+
+/* Consumer: release n bytes obtained from ring_peek */
+static inline void ring_consume(struct ring *r, uint16_t n){
+    __atomic_store_n(&r->tail, (uint16_t)(r->tail+n), __ATOMIC_RELEASE);
+}
+
+/* Copy as much of src as fits, returns number of bytes taken */
+static inline uint16_t ring_write(struct ring *r, const uint8_t *src, uint16_t len){
+    uint16_t done=0;
+    while(done<len){
+        uint8_t *p;
+        uint16_t n=ring_reserve(r, &p);
+        if(n==0)
+            break;
+        if(n>len-done)
+            n=len-done;
+        memcpy(p, src+done, n);
+        ring_commit(r, n);
+        done+=n;
+    }
+    return done;
+}
+
+/* Copy up to len bytes out, returns number of bytes read */
+static inline uint16_t ring_read(struct ring *r, uint8_t *dst, uint16_t len){
+    uint16_t done=0;
+    while(done<len){
+        uint8_t *p;
+        uint16_t n=ring_peek(r, &p);
+        if(n==0)
+            break;
+        if(n>len-done)
+            n=len-done;
+        memcpy(dst+done, p, n);
+        ring_consume(r, n);
+        done+=n;
+    }
+    return done;
+}
+
+#endif
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+#include <atom.h>
+
+#include "idle.h"
+#include "sim.h"
+
+pthread_mutex_t sim_primask=PTHREAD_MUTEX_INITIALIZER;
+static __thread bool masked;
+
+static pthread_cond_t irq_cond;     //dispatcher waits for a pending IRQ
+static pthread_cond_t wfi_cond;     //idle_sleep waits for any IRQ
+static pthread_cond_t done_cond;    //an ISR has returned
+static uint8_t irq_enabled[NVIC_IRQ_COUNT];
+static uint8_t irq_pending[NVIC_IRQ_COUNT];
+static struct timespec sim_start;
+
+struct idle_stats idle_stats;
+uint32_t idle_tick_cycles;
+
+/* Defaults for the vectors the firmware does not handle */
+#define SIM_DEFAULT_ISR(name) \
+    __attribute__((weak)) void name(void) {}
+SIM_DEFAULT_ISR(exti1_isr)
+SIM_DEFAULT_ISR(dma1_channel1_isr)
+SIM_DEFAULT_ISR(dma1_channel2_isr)
+SIM_DEFAULT_ISR(dma1_channel3_isr)
+SIM_DEFAULT_ISR(dma1_channel4_isr)
+SIM_DEFAULT_ISR(dma1_channel5_isr)
+SIM_DEFAULT_ISR(dma1_channel6_isr)
+SIM_DEFAULT_ISR(dma1_channel7_isr)
+SIM_DEFAULT_ISR(usb_lp_can_rx0_isr)
+SIM_DEFAULT_ISR(usart1_isr)
+SIM_DEFAULT_ISR(usart2_isr)
+SIM_DEFAULT_ISR(usart3_isr)
+SIM_DEFAULT_ISR(usb_wakeup_isr)
+
+static void (*const vector_table[NVIC_IRQ_COUNT])(void)={
+    [NVIC_EXTI1_IRQ]=exti1_isr,
+    [NVIC_DMA1_CHANNEL1_IRQ]=dma1_channel1_isr,
+    [NVIC_DMA1_CHANNEL2_IRQ]=dma1_channel2_isr,
+    [NVIC_DMA1_CHANNEL3_IRQ]=dma1_channel3_isr,
+    [NVIC_DMA1_CHANNEL4_IRQ]=dma1_channel4_isr,
+    [NVIC_DMA1_CHANNEL5_IRQ]=dma1_channel5_isr,
+    [NVIC_DMA1_CHANNEL6_IRQ]=dma1_channel6_isr,
+    [NVIC_DMA1_CHANNEL7_IRQ]=dma1_channel7_isr,
+    [NVIC_USB_LP_CAN_RX0_IRQ]=usb_lp_can_rx0_isr,
+    [NVIC_USART1_IRQ]=usart1_isr,
+    [NVIC_USART2_IRQ]=usart2_isr,
+    [NVIC_USART3_IRQ]=usart3_isr,
+    [NVIC_USB_WAKEUP_IRQ]=usb_wakeup_isr,
+};
+
+bool cm_mask_interrupts(bool mask){
+    bool old=masked;
+    if(mask && !old){
+        pthread_mutex_lock(&sim_primask);
+        masked=true;
+    }else if(!mask && old){
+        masked=false;
+        pthread_mutex_unlock(&sim_primask);
+    }
+    return old;
+}
+
+uint64_t sim_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec-sim_start.tv_sec)*1000000000u
+        +ts.tv_nsec-sim_start.tv_nsec;
+}
+
+void sim_deadline(struct timespec *ts, uint32_t ticks){
+    uint64_t ns=(uint64_t)ticks*(1000000000/SYSTEM_TICKS_PER_SEC);
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec+=ns/1000000000;
+    ts->tv_nsec+=ns%1000000000;
+    if(ts->tv_nsec>=1000000000){
+        ts->tv_sec++;
+        ts->tv_nsec-=1000000000;
+    }
+}
+
+void sim_cond_init(pthread_cond_t *cond){
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+int sim_wait(pthread_cond_t *cond, const struct timespec *deadline){
+    if(deadline==NULL)
+        return pthread_cond_wait(cond, &sim_primask);
+    return pthread_cond_timedwait(cond, &sim_primask, deadline);
+}
+
+const char *sim_path(const char *name){
+    const char *dir=getenv("SIM_DIR");
+    char *path;
+    if(asprintf(&path, "%s/%s", dir?dir:".", name)<0)
+        abort();
+    return path;
+}
+
+void sim_irq_raise(int irqn){
+    bool m=cm_mask_interrupts(true);
+    irq_pending[irqn]=1;
+    if(irq_enabled[irqn])
+        pthread_cond_signal(&irq_cond);
+    pthread_cond_broadcast(&wfi_cond);
+    cm_mask_interrupts(m);
+}
+
+void sim_irq_sync(int irqn){
+    while(irq_pending[irqn] && irq_enabled[irqn])
+        sim_wait(&done_cond, NULL);
+}
+
+void nvic_enable_irq(uint8_t irqn){
+    bool m=cm_mask_interrupts(true);
+    irq_enabled[irqn]=1;
+    if(irq_pending[irqn])
+        pthread_cond_signal(&irq_cond);
+    cm_mask_interrupts(m);
+}
+
+void nvic_set_priority(uint8_t irqn __unused, uint8_t priority __unused){
+}
+
+static int irq_next(void){
+    for(int i=0;i<NVIC_IRQ_COUNT;i++)
+        if(irq_pending[i] && irq_enabled[i])
+            return i;
+    return -1;
+}
+
+/*
+ * The core taking exceptions: ISRs run one at a time, lowest number
+ * first, with PRIMASK held. Nothing preempts them, and they wait while
+ * firmware code is masked.
+ */
+static void *irq_thread(void *arg __unused){
+    cm_mask_interrupts(true);
+    while(1){
+        int irqn=irq_next();
+        if(irqn<0){
+            sim_wait(&irq_cond, NULL);
+            continue;
+        }
+        irq_pending[irqn]=0;
+        vector_table[irqn]();
+        pthread_cond_broadcast(&done_cond);
+    }
+    return NULL;
+}
+
+__attribute__((constructor))
+static void sim_core_init(void){
+    pthread_t t;
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+    sim_cond_init(&irq_cond);
+    sim_cond_init(&wfi_cond);
+    sim_cond_init(&done_cond);
+    if(pthread_create(&t, NULL, irq_thread, NULL)!=0)
+        abort();
+}
+
+bool dwt_enable_cycle_counter(void){
+    return true;
+}
+
+uint32_t dwt_read_cycle_counter(void){
+    return (uint32_t)(sim_now_ns()*(rcc_ahb_frequency/1000000)/1000);
+}
+
+void idle_tick_setup(void){
+    idle_tick_cycles=rcc_ahb_frequency/SYSTEM_TICKS_PER_SEC;
+}
+
+/* WFI: nothing to catch up, kernel timeouts run on their own clocks */
+void idle_sleep(uint32_t ticks){
+    struct timespec ts;
+    uint64_t t0=sim_now_ns();
+    idle_stats.sleeps++;
+    if(irq_next()<0){
+        if(ticks){
+            sim_deadline(&ts, ticks);
+            sim_wait(&wfi_cond, &ts);
+        }else{
+            sim_wait(&wfi_cond, NULL);
+        }
+    }
+    idle_stats.sleep_cycles+=(sim_now_ns()-t0)*(rcc_ahb_frequency/1000000)/1000;
+}
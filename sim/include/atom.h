@@ -0,0 +1,53 @@
+#ifndef SIM_ATOM_H_INCLUDED
+#define SIM_ATOM_H_INCLUDED
+
+/*
+ * Host stand-in for the atomthreads kernel: threads are pthreads, the
+ * critical section is the simulated PRIMASK (cm_mask_interrupts) and
+ * blocking calls wait on condition variables under it. Priorities are
+ * recorded but not enforced, threads run truly in parallel.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <libopencm3/cm3/cortex.h>
+
+#define TRUE 1
+#define FALSE 0
+
+#define SYSTEM_TICKS_PER_SEC 1000
+
+#define ATOM_OK             0
+#define ATOM_ERROR          1
+#define ATOM_TIMEOUT        2
+#define ATOM_WOULDBLOCK     3
+#define ATOM_ERR_CONTEXT    200
+#define ATOM_ERR_PARAM      201
+#define ATOM_ERR_OVF        203
+
+#define CRITICAL_STORE      bool __irq_flags
+#define CRITICAL_START()    __irq_flags = cm_mask_interrupts(true)
+#define CRITICAL_END()      (void)cm_mask_interrupts(__irq_flags)
+
+typedef struct atom_tcb {
+    pthread_t thread;
+    void (*entry_point)(uint32_t);
+    uint32_t entry_param;
+    uint8_t priority;
+    struct atom_tcb *next;
+} ATOM_TCB;
+
+extern uint8_t atomOSStarted;
+
+uint8_t atomOSInit(void *idle_thread_stack_bottom, uint32_t idle_thread_stack_size,
+        uint8_t idle_thread_stack_check);
+void atomOSStart(void);
+uint8_t atomThreadCreate(ATOM_TCB *tcb_ptr, uint8_t priority,
+        void (*entry_point)(uint32_t), uint32_t entry_param,
+        void *stack_bottom, uint32_t stack_size, uint8_t stack_check);
+ATOM_TCB *atomCurrentContext(void);
+void atomIntEnter(void);
+void atomIntExit(uint8_t timer_tick);
+
+#endif
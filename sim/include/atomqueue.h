@@ -0,0 +1,22 @@
+#ifndef SIM_ATOMQUEUE_H_INCLUDED
+#define SIM_ATOMQUEUE_H_INCLUDED
+
+#include <atom.h>
+
+typedef struct atom_queue {
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    uint8_t *buff_ptr;
+    uint32_t unit_size;
+    uint32_t max_num_msgs;
+    uint32_t insert_index;
+    uint32_t remove_index;
+    uint32_t num_msgs_stored;
+} ATOM_QUEUE;
+
+uint8_t atomQueueCreate(ATOM_QUEUE *qptr, uint8_t *buff_ptr,
+        uint32_t unit_size, uint32_t max_num_msgs);
+uint8_t atomQueueGet(ATOM_QUEUE *qptr, int32_t timeout, uint8_t *msgptr);
+uint8_t atomQueuePut(ATOM_QUEUE *qptr, int32_t timeout, uint8_t *msgptr);
+
+#endif
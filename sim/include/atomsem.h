@@ -0,0 +1,15 @@
+#ifndef SIM_ATOMSEM_H_INCLUDED
+#define SIM_ATOMSEM_H_INCLUDED
+
+#include <atom.h>
+
+typedef struct atom_sem {
+    pthread_cond_t cond;
+    uint8_t count;
+} ATOM_SEM;
+
+uint8_t atomSemCreate(ATOM_SEM *sem, uint8_t initial_count);
+uint8_t atomSemGet(ATOM_SEM *sem, int32_t timeout);
+uint8_t atomSemPut(ATOM_SEM *sem);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef SIM_ATOMTIMER_H_INCLUDED
+#define SIM_ATOMTIMER_H_INCLUDED
+
+#include <atom.h>
+
+/* The system tick follows the monotonic clock */
+uint32_t atomTimeGet(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SIM_LIBOPENCM3_COMMON_H_INCLUDED
+#define SIM_LIBOPENCM3_COMMON_H_INCLUDED
+
+/* Host stand-in for the parts of libopencm3 the firmware uses */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define __unused __attribute__((unused))
+#define __maybe_unused __attribute__((unused))
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef SIM_LIBOPENCM3_CORTEX_H_INCLUDED
+#define SIM_LIBOPENCM3_CORTEX_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+/*
+ * PRIMASK: one global lock, held by the thread that masked. ISRs run
+ * with it held, so a masked section excludes them as on the chip.
+ */
+bool cm_mask_interrupts(bool mask);
+
+#endif
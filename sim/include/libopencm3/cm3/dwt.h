@@ -0,0 +1,10 @@
+#ifndef SIM_LIBOPENCM3_DWT_H_INCLUDED
+#define SIM_LIBOPENCM3_DWT_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+/* Counts the monotonic clock scaled to rcc_ahb_frequency */
+bool dwt_enable_cycle_counter(void);
+uint32_t dwt_read_cycle_counter(void);
+
+#endif
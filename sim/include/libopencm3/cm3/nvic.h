@@ -0,0 +1,41 @@
+#ifndef SIM_LIBOPENCM3_NVIC_H_INCLUDED
+#define SIM_LIBOPENCM3_NVIC_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+/* STM32F1 interrupt numbers */
+#define NVIC_PENDSV_IRQ             -2
+#define NVIC_SYSTICK_IRQ            -1
+#define NVIC_EXTI1_IRQ              7
+#define NVIC_DMA1_CHANNEL1_IRQ      11
+#define NVIC_DMA1_CHANNEL2_IRQ      12
+#define NVIC_DMA1_CHANNEL3_IRQ      13
+#define NVIC_DMA1_CHANNEL4_IRQ      14
+#define NVIC_DMA1_CHANNEL5_IRQ      15
+#define NVIC_DMA1_CHANNEL6_IRQ      16
+#define NVIC_DMA1_CHANNEL7_IRQ      17
+#define NVIC_USB_LP_CAN_RX0_IRQ     20
+#define NVIC_USART1_IRQ             37
+#define NVIC_USART2_IRQ             38
+#define NVIC_USART3_IRQ             39
+#define NVIC_USB_WAKEUP_IRQ         42
+#define NVIC_IRQ_COUNT              68
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_set_priority(uint8_t irqn, uint8_t priority);
+
+void exti1_isr(void);
+void dma1_channel1_isr(void);
+void dma1_channel2_isr(void);
+void dma1_channel3_isr(void);
+void dma1_channel4_isr(void);
+void dma1_channel5_isr(void);
+void dma1_channel6_isr(void);
+void dma1_channel7_isr(void);
+void usb_lp_can_rx0_isr(void);
+void usart1_isr(void);
+void usart2_isr(void);
+void usart3_isr(void);
+void usb_wakeup_isr(void);
+
+#endif
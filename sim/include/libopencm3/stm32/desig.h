@@ -0,0 +1,6 @@
+#ifndef SIM_LIBOPENCM3_DESIG_H_INCLUDED
+#define SIM_LIBOPENCM3_DESIG_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+#endif
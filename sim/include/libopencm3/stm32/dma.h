@@ -0,0 +1,54 @@
+#ifndef SIM_LIBOPENCM3_DMA_H_INCLUDED
+#define SIM_LIBOPENCM3_DMA_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+/*
+ * DMA1 channels move bytes between the USART ptys and firmware memory.
+ * Addresses are passed as uint32_t as on the chip, the simulator is
+ * linked -no-pie so static buffers sit below 4 GiB.
+ */
+#define DMA1 1
+
+#define DMA_CHANNEL1 1
+#define DMA_CHANNEL2 2
+#define DMA_CHANNEL3 3
+#define DMA_CHANNEL4 4
+#define DMA_CHANNEL5 5
+#define DMA_CHANNEL6 6
+#define DMA_CHANNEL7 7
+
+extern volatile uint32_t sim_dma_cndtr[8];
+#define DMA_CNDTR(dma, channel) (sim_dma_cndtr[(channel)])
+
+#define DMA_GIF  (1 << 0)
+#define DMA_TCIF (1 << 1)
+#define DMA_HTIF (1 << 2)
+#define DMA_TEIF (1 << 3)
+
+#define DMA_CCR_PL_LOW          (0 << 12)
+#define DMA_CCR_PL_MEDIUM       (1 << 12)
+#define DMA_CCR_PL_HIGH         (2 << 12)
+#define DMA_CCR_PL_VERY_HIGH    (3 << 12)
+#define DMA_CCR_MSIZE_8BIT      (0 << 10)
+#define DMA_CCR_PSIZE_8BIT      (0 << 8)
+
+void dma_channel_reset(uint32_t dma, uint8_t channel);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts);
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts);
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio);
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size);
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size);
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel);
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel);
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel);
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel);
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+
+#endif
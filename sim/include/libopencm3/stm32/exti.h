@@ -0,0 +1,19 @@
+#ifndef SIM_LIBOPENCM3_EXTI_H_INCLUDED
+#define SIM_LIBOPENCM3_EXTI_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+#define EXTI1 (1 << 1)
+
+enum exti_trigger_type {
+    EXTI_TRIGGER_RISING,
+    EXTI_TRIGGER_FALLING,
+    EXTI_TRIGGER_BOTH
+};
+
+void exti_set_trigger(uint32_t extis, enum exti_trigger_type trig);
+void exti_enable_request(uint32_t extis);
+void exti_reset_request(uint32_t extis);
+void exti_select_source(uint32_t exti, uint32_t gpioport);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SIM_LIBOPENCM3_GPIO_H_INCLUDED
+#define SIM_LIBOPENCM3_GPIO_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+/* Ports are indices into sim_gpio, an input reads back the output latch */
+#define GPIOA 0
+#define GPIOB 1
+#define GPIOC 2
+
+#define GPIO0  (1 << 0)
+#define GPIO1  (1 << 1)
+#define GPIO2  (1 << 2)
+#define GPIO3  (1 << 3)
+#define GPIO4  (1 << 4)
+#define GPIO5  (1 << 5)
+#define GPIO6  (1 << 6)
+#define GPIO7  (1 << 7)
+#define GPIO8  (1 << 8)
+#define GPIO9  (1 << 9)
+#define GPIO10 (1 << 10)
+#define GPIO11 (1 << 11)
+#define GPIO12 (1 << 12)
+#define GPIO13 (1 << 13)
+#define GPIO14 (1 << 14)
+#define GPIO15 (1 << 15)
+
+#define GPIO_USART1_TX GPIO9
+#define GPIO_USART1_RX GPIO10
+#define GPIO_USART2_TX GPIO2
+#define GPIO_USART2_RX GPIO3
+#define GPIO_USART3_TX GPIO10
+#define GPIO_USART3_RX GPIO11
+#define GPIO_USART3_PR_TX GPIO10
+#define GPIO_USART3_PR_RX GPIO11
+
+#define GPIO_MODE_INPUT         0
+#define GPIO_MODE_OUTPUT_10_MHZ 1
+#define GPIO_MODE_OUTPUT_2_MHZ  2
+#define GPIO_MODE_OUTPUT_50_MHZ 3
+
+#define GPIO_CNF_INPUT_ANALOG           0
+#define GPIO_CNF_INPUT_FLOAT            1
+#define GPIO_CNF_INPUT_PULL_UPDOWN      2
+#define GPIO_CNF_OUTPUT_PUSHPULL        0
+#define GPIO_CNF_OUTPUT_OPENDRAIN       1
+#define GPIO_CNF_OUTPUT_ALTFN_PUSHPULL  2
+#define GPIO_CNF_OUTPUT_ALTFN_OPENDRAIN 3
+
+extern volatile uint32_t sim_afio_mapr;
+#define AFIO_MAPR sim_afio_mapr
+#define AFIO_MAPR_SWJ_CFG_JTAG_OFF_SW_ON        (2 << 24)
+#define AFIO_MAPR_USART3_REMAP_PARTIAL_REMAP    (1 << 4)
+
+void gpio_set_mode(uint32_t gpioport, uint8_t mode, uint8_t cnf, uint16_t gpios);
+void gpio_set(uint32_t gpioport, uint16_t gpios);
+void gpio_clear(uint32_t gpioport, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SIM_LIBOPENCM3_RCC_H_INCLUDED
+#define SIM_LIBOPENCM3_RCC_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+
+enum rcc_periph_clken {
+    RCC_GPIOA, RCC_GPIOB, RCC_GPIOC, RCC_AFIO,
+    RCC_USART1, RCC_USART2, RCC_USART3, RCC_DMA1
+};
+
+extern uint32_t rcc_ahb_frequency;
+extern uint32_t rcc_apb1_frequency;
+extern uint32_t rcc_apb2_frequency;
+
+void rcc_clock_setup_in_hsi_out_48mhz(void);
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+
+#endif
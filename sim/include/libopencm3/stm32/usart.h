@@ -0,0 +1,59 @@
+#ifndef SIM_LIBOPENCM3_USART_H_INCLUDED
+#define SIM_LIBOPENCM3_USART_H_INCLUDED
+
+#include <libopencm3/cm3/common.h>
+#include <libopencm3/stm32/gpio.h>
+
+/* USARTs are indices into sim_usart, each one backed by a pty */
+#define USART1 1
+#define USART2 2
+#define USART3 3
+
+struct sim_usart_regs {
+    volatile uint32_t sr;
+    volatile uint32_t dr;
+    volatile uint32_t cr1;
+    volatile uint32_t cr3;
+};
+extern struct sim_usart_regs sim_usart_regs[4];
+/* Accessing DR clears RXNE and IDLE, as the SR then DR read does */
+volatile uint32_t *sim_usart_dr(uint32_t usart);
+
+#define USART_SR(usart)     (sim_usart_regs[(usart)].sr)
+#define USART_DR(usart)     (*sim_usart_dr(usart))
+#define USART_CR1(usart)    (sim_usart_regs[(usart)].cr1)
+#define USART_CR3(usart)    (sim_usart_regs[(usart)].cr3)
+
+#define USART_SR_ORE        (1 << 3)
+#define USART_SR_IDLE       (1 << 4)
+#define USART_SR_RXNE       (1 << 5)
+#define USART_SR_TC         (1 << 6)
+#define USART_SR_TXE        (1 << 7)
+
+#define USART_CR1_IDLEIE    (1 << 4)
+#define USART_CR1_RXNEIE    (1 << 5)
+#define USART_CR1_TCIE      (1 << 6)
+#define USART_CR1_TXEIE     (1 << 7)
+#define USART_CR1_UE        (1 << 13)
+
+#define USART_CR3_DMAR      (1 << 6)
+#define USART_CR3_DMAT      (1 << 7)
+
+#define USART_PARITY_NONE       0
+#define USART_STOPBITS_1        0
+#define USART_FLOWCONTROL_NONE  0
+#define USART_MODE_TX_RX        0x0c
+
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_enable(uint32_t usart);
+void usart_send_blocking(uint32_t usart, uint16_t data);
+uint16_t usart_recv(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SIM_LIBOPENCM3_AUDIO_H_INCLUDED
+#define SIM_LIBOPENCM3_AUDIO_H_INCLUDED
+
+#include <libopencm3/usb/usbstd.h>
+#define USB_AUDIO_DT_CS_INTERFACE 0x24
+#define USB_AUDIO_DT_CS_ENDPOINT 0x25
+#define USB_AUDIO_SUBCLASS_CONTROL 1
+#define USB_AUDIO_SUBCLASS_MIDISTREAMING 3
+#define USB_AUDIO_TYPE_HEADER 1
+struct usb_audio_header_descriptor_head { uint8_t bLength, bDescriptorType, bDescriptorSubtype; uint16_t bcdADC; uint16_t wTotalLength; uint8_t binCollection; } __attribute__((packed));
+struct usb_audio_header_descriptor_body { uint8_t baInterfaceNr; } __attribute__((packed));
+
+#endif
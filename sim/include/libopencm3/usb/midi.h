@@ -0,0 +1,21 @@
+#ifndef SIM_LIBOPENCM3_MIDI_H_INCLUDED
+#define SIM_LIBOPENCM3_MIDI_H_INCLUDED
+
+#include <libopencm3/usb/audio.h>
+#define USB_MIDI_SUBTYPE_MS_HEADER 1
+#define USB_MIDI_SUBTYPE_MIDI_IN_JACK 2
+#define USB_MIDI_SUBTYPE_MIDI_OUT_JACK 3
+#define USB_MIDI_SUBTYPE_MS_GENERAL 1
+#define USB_MIDI_JACK_TYPE_EMBEDDED 1
+#define USB_MIDI_JACK_TYPE_EXTERNAL 2
+struct usb_midi_header_descriptor { uint8_t bLength, bDescriptorType, bDescriptorSubtype; uint16_t bcdMSC, wTotalLength; } __attribute__((packed));
+struct usb_midi_in_jack_descriptor { uint8_t bLength, bDescriptorType, bDescriptorSubtype, bJackType, bJackID, iJack; } __attribute__((packed));
+struct usb_midi_out_jack_descriptor_head { uint8_t bLength, bDescriptorType, bDescriptorSubtype, bJackType, bJackID, bNrInputPins; } __attribute__((packed));
+struct usb_midi_out_jack_descriptor_source { uint8_t baSourceID, baSourcePin; } __attribute__((packed));
+struct usb_midi_out_jack_descriptor_tail { uint8_t iJack; } __attribute__((packed));
+struct usb_midi_out_jack_descriptor { struct usb_midi_out_jack_descriptor_head head; struct usb_midi_out_jack_descriptor_source source[1]; struct usb_midi_out_jack_descriptor_tail tail; } __attribute__((packed));
+struct usb_midi_endpoint_descriptor_head { uint8_t bLength, bDescriptorType, bDescriptorSubType, bNumEmbMIDIJack; } __attribute__((packed));
+struct usb_midi_endpoint_descriptor_body { uint8_t baAssocJackID; } __attribute__((packed));
+struct usb_midi_endpoint_descriptor { struct usb_midi_endpoint_descriptor_head head; struct usb_midi_endpoint_descriptor_body jack[1]; } __attribute__((packed));
+
+#endif
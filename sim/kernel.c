@@ -0,0 +1,182 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atom.h>
+#include <atomsem.h>
+#include <atomqueue.h>
+#include <atomtimer.h>
+
+#include "sim.h"
+
+uint8_t atomOSStarted;
+static ATOM_TCB *created;           //threads waiting for atomOSStart
+static __thread ATOM_TCB *current;
+static __thread int isr_depth;
+
+static void *thread_entry(void *arg){
+    ATOM_TCB *tcb=arg;
+    current=tcb;
+    tcb->entry_point(tcb->entry_param);
+    return NULL;
+}
+
+static uint8_t thread_start(ATOM_TCB *tcb){
+    return pthread_create(&tcb->thread, NULL, thread_entry, tcb)==0?
+        ATOM_OK:ATOM_ERROR;
+}
+
+/* The kernel idle thread is not needed, the host idles by itself */
+uint8_t atomOSInit(void *idle_thread_stack_bottom __unused,
+        uint32_t idle_thread_stack_size __unused,
+        uint8_t idle_thread_stack_check __unused){
+    return ATOM_OK;
+}
+
+uint8_t atomThreadCreate(ATOM_TCB *tcb_ptr, uint8_t priority,
+        void (*entry_point)(uint32_t), uint32_t entry_param,
+        void *stack_bottom __unused, uint32_t stack_size __unused,
+        uint8_t stack_check __unused){
+    tcb_ptr->entry_point=entry_point;
+    tcb_ptr->entry_param=entry_param;
+    tcb_ptr->priority=priority;
+    if(atomOSStarted)
+        return thread_start(tcb_ptr);
+    tcb_ptr->next=created;
+    created=tcb_ptr;
+    return ATOM_OK;
+}
+
+/* Starts the threads and unmasks; like the real one it does not return */
+void atomOSStart(void){
+    atomOSStarted=TRUE;
+    for(ATOM_TCB *tcb=created;tcb;tcb=tcb->next)
+        if(thread_start(tcb)!=ATOM_OK)
+            abort();
+    cm_mask_interrupts(false);
+    pthread_exit(NULL);
+}
+
+ATOM_TCB *atomCurrentContext(void){
+    return isr_depth?NULL:current;
+}
+
+void atomIntEnter(void){
+    isr_depth++;
+}
+
+void atomIntExit(uint8_t timer_tick __unused){
+    isr_depth--;
+}
+
+uint32_t atomTimeGet(void){
+    return (uint32_t)(sim_now_ns()/(1000000000/SYSTEM_TICKS_PER_SEC));
+}
+
+/*
+ * Wait for cond under PRIMASK. timeout as in atomthreads: 0 forever,
+ * -1 not at all, else ticks. Returns ATOM_OK when woken for a retry.
+ */
+static uint8_t wait_timeout(pthread_cond_t *cond, int32_t timeout,
+        const struct timespec *deadline){
+    if(timeout<0)
+        return ATOM_WOULDBLOCK;
+    if(atomCurrentContext()==NULL)
+        return ATOM_ERR_CONTEXT;
+    if(sim_wait(cond, timeout?deadline:NULL)==ETIMEDOUT)
+        return ATOM_TIMEOUT;
+    return ATOM_OK;
+}
+
+uint8_t atomSemCreate(ATOM_SEM *sem, uint8_t initial_count){
+    sim_cond_init(&sem->cond);
+    sem->count=initial_count;
+    return ATOM_OK;
+}
+
+uint8_t atomSemGet(ATOM_SEM *sem, int32_t timeout){
+    CRITICAL_STORE;
+    struct timespec deadline;
+    uint8_t status=ATOM_OK;
+    if(timeout>0)
+        sim_deadline(&deadline, timeout);
+    CRITICAL_START();
+    while(sem->count==0 && status==ATOM_OK)
+        status=wait_timeout(&sem->cond, timeout, &deadline);
+    if(sem->count){
+        sem->count--;
+        status=ATOM_OK;
+    }
+    CRITICAL_END();
+    return status;
+}
+
+uint8_t atomSemPut(ATOM_SEM *sem){
+    CRITICAL_STORE;
+    uint8_t status=ATOM_OK;
+    CRITICAL_START();
+    if(sem->count==255){
+        status=ATOM_ERR_OVF;
+    }else{
+        sem->count++;
+        pthread_cond_signal(&sem->cond);
+    }
+    CRITICAL_END();
+    return status;
+}
+
+uint8_t atomQueueCreate(ATOM_QUEUE *qptr, uint8_t *buff_ptr,
+        uint32_t unit_size, uint32_t max_num_msgs){
+    if(buff_ptr==NULL || unit_size==0 || max_num_msgs==0)
+        return ATOM_ERR_PARAM;
+    sim_cond_init(&qptr->not_empty);
+    sim_cond_init(&qptr->not_full);
+    qptr->buff_ptr=buff_ptr;
+    qptr->unit_size=unit_size;
+    qptr->max_num_msgs=max_num_msgs;
+    qptr->insert_index=0;
+    qptr->remove_index=0;
+    qptr->num_msgs_stored=0;
+    return ATOM_OK;
+}
+
+uint8_t atomQueueGet(ATOM_QUEUE *qptr, int32_t timeout, uint8_t *msgptr){
+    CRITICAL_STORE;
+    struct timespec deadline;
+    uint8_t status=ATOM_OK;
+    if(timeout>0)
+        sim_deadline(&deadline, timeout);
+    CRITICAL_START();
+    while(qptr->num_msgs_stored==0 && status==ATOM_OK)
+        status=wait_timeout(&qptr->not_empty, timeout, &deadline);
+    if(qptr->num_msgs_stored){
+        memcpy(msgptr, qptr->buff_ptr+qptr->remove_index*qptr->unit_size,
+                qptr->unit_size);
+        qptr->remove_index=(qptr->remove_index+1)%qptr->max_num_msgs;
+        qptr->num_msgs_stored--;
+        pthread_cond_signal(&qptr->not_full);
+        status=ATOM_OK;
+    }
+    CRITICAL_END();
+    return status;
+}
+
+uint8_t atomQueuePut(ATOM_QUEUE *qptr, int32_t timeout, uint8_t *msgptr){
+    CRITICAL_STORE;
+    struct timespec deadline;
+    uint8_t status=ATOM_OK;
+    if(timeout>0)
+        sim_deadline(&deadline, timeout);
+    CRITICAL_START();
+    while(qptr->num_msgs_stored==qptr->max_num_msgs && status==ATOM_OK)
+        status=wait_timeout(&qptr->not_full, timeout, &deadline);
+    if(qptr->num_msgs_stored<qptr->max_num_msgs){
+        memcpy(qptr->buff_ptr+qptr->insert_index*qptr->unit_size, msgptr,
+                qptr->unit_size);
+        qptr->insert_index=(qptr->insert_index+1)%qptr->max_num_msgs;
+        qptr->num_msgs_stored++;
+        pthread_cond_signal(&qptr->not_empty);
+        status=ATOM_OK;
+    }
+    CRITICAL_END();
+    return status;
+}
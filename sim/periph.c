@@ -0,0 +1,376 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
+
+#include "sim.h"
+
+uint32_t rcc_ahb_frequency=48000000;
+uint32_t rcc_apb1_frequency=24000000;
+uint32_t rcc_apb2_frequency=48000000;
+
+void rcc_clock_setup_in_hsi_out_48mhz(void){
+}
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken __unused){
+}
+
+/* GPIO: output latches only, the LEDs are not shown anywhere */
+static volatile uint16_t sim_gpio[3];
+volatile uint32_t sim_afio_mapr;
+
+void gpio_set_mode(uint32_t gpioport __unused, uint8_t mode __unused,
+        uint8_t cnf __unused, uint16_t gpios __unused){
+}
+
+void gpio_set(uint32_t gpioport, uint16_t gpios){
+    __atomic_or_fetch(&sim_gpio[gpioport], gpios, __ATOMIC_RELAXED);
+}
+
+void gpio_clear(uint32_t gpioport, uint16_t gpios){
+    __atomic_and_fetch(&sim_gpio[gpioport], (uint16_t)~gpios, __ATOMIC_RELAXED);
+}
+
+void gpio_toggle(uint32_t gpioport, uint16_t gpios){
+    __atomic_xor_fetch(&sim_gpio[gpioport], gpios, __ATOMIC_RELAXED);
+}
+
+uint16_t gpio_get(uint32_t gpioport, uint16_t gpios){
+    return sim_gpio[gpioport]&gpios;
+}
+
+/* No button on the host, the edge never comes */
+void exti_set_trigger(uint32_t extis __unused, enum exti_trigger_type trig __unused){
+}
+
+void exti_enable_request(uint32_t extis __unused){
+}
+
+void exti_reset_request(uint32_t extis __unused){
+}
+
+void exti_select_source(uint32_t exti __unused, uint32_t gpioport __unused){
+}
+
+/*
+ * DMA1: a channel only records its setup, the USART threads below do
+ * the transfers. The peripheral address tells which USART it serves.
+ */
+struct sim_dma {
+    uint32_t paddr;
+    uint32_t maddr;
+    uint16_t size;      //CNDTR as programmed, reloaded in circular mode
+    uint8_t en;
+    uint8_t circ;
+    uint8_t from_mem;
+    uint8_t htie;
+    uint8_t tcie;
+    uint32_t flags;
+};
+static struct sim_dma sim_dma[8];
+volatile uint32_t sim_dma_cndtr[8];
+
+static void dma_raise(uint8_t channel, uint32_t flag, uint8_t enabled){
+    sim_dma[channel].flags|=flag|DMA_GIF;
+    if(enabled)
+        sim_irq_raise(NVIC_DMA1_CHANNEL1_IRQ+channel-1);
+}
+
+static int dma_usart(uint8_t channel){
+    for(int u=USART1;u<=USART3;u++)
+        if(sim_dma[channel].paddr==(uint32_t)(uintptr_t)&sim_usart_regs[u].dr)
+            return u;
+    return 0;
+}
+
+void dma_channel_reset(uint32_t dma __unused, uint8_t channel){
+    memset(&sim_dma[channel], 0, sizeof(sim_dma[channel]));
+    sim_dma_cndtr[channel]=0;
+}
+
+void dma_clear_interrupt_flags(uint32_t dma __unused, uint8_t channel, uint32_t interrupts){
+    sim_dma[channel].flags&=~interrupts;
+}
+
+bool dma_get_interrupt_flag(uint32_t dma __unused, uint8_t channel, uint32_t interrupts){
+    return (sim_dma[channel].flags&interrupts)!=0;
+}
+
+void dma_set_priority(uint32_t dma __unused, uint8_t channel __unused, uint32_t prio __unused){
+}
+
+void dma_set_memory_size(uint32_t dma __unused, uint8_t channel __unused, uint32_t mem_size __unused){
+}
+
+void dma_set_peripheral_size(uint32_t dma __unused, uint8_t channel __unused,
+        uint32_t peripheral_size __unused){
+}
+
+void dma_enable_memory_increment_mode(uint32_t dma __unused, uint8_t channel __unused){
+}
+
+void dma_enable_circular_mode(uint32_t dma __unused, uint8_t channel){
+    sim_dma[channel].circ=1;
+}
+
+void dma_set_read_from_peripheral(uint32_t dma __unused, uint8_t channel){
+    sim_dma[channel].from_mem=0;
+}
+
+void dma_set_read_from_memory(uint32_t dma __unused, uint8_t channel){
+    sim_dma[channel].from_mem=1;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t dma __unused, uint8_t channel){
+    sim_dma[channel].htie=1;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t dma __unused, uint8_t channel){
+    sim_dma[channel].tcie=1;
+}
+
+void dma_set_peripheral_address(uint32_t dma __unused, uint8_t channel, uint32_t address){
+    sim_dma[channel].paddr=address;
+}
+
+void dma_set_memory_address(uint32_t dma __unused, uint8_t channel, uint32_t address){
+    sim_dma[channel].maddr=address;
+}
+
+void dma_set_number_of_data(uint32_t dma __unused, uint8_t channel, uint16_t number){
+    sim_dma[channel].size=number;
+    sim_dma_cndtr[channel]=number;
+}
+
+static void usart_kick(int u);
+
+void dma_enable_channel(uint32_t dma __unused, uint8_t channel){
+    bool m=cm_mask_interrupts(true);
+    sim_dma[channel].en=1;
+    usart_kick(dma_usart(channel));
+    cm_mask_interrupts(m);
+}
+
+void dma_disable_channel(uint32_t dma __unused, uint8_t channel){
+    sim_dma[channel].en=0;
+}
+
+/*
+ * USARTs: each one is a pty, linked as $SIM_DIR/uart<n>. The slave side
+ * is kept open by the simulator, so programs may come and go, and raw,
+ * so MIDI bytes pass untouched. Line rate is not modelled: bytes move as
+ * fast as the firmware takes them.
+ */
+struct sim_usart {
+    int fd;                 //pty master
+    pthread_t rx, tx;
+    pthread_cond_t rx_cond; //RXNE cleared
+    pthread_cond_t tx_cond; //a transmit channel was armed
+};
+struct sim_usart_regs sim_usart_regs[4];
+static struct sim_usart sim_usart[4]={[0 ... 3]={.fd=-1}};
+
+volatile uint32_t *sim_usart_dr(uint32_t usart){
+    sim_usart_regs[usart].sr&=~(USART_SR_RXNE|USART_SR_IDLE);
+    pthread_cond_broadcast(&sim_usart[usart].rx_cond);
+    return &sim_usart_regs[usart].dr;
+}
+
+static void usart_kick(int u){
+    if(u)
+        pthread_cond_broadcast(&sim_usart[u].tx_cond);
+}
+
+static int usart_channel(int u, uint8_t from_mem, uint32_t cr3_en){
+    if((sim_usart_regs[u].cr3&cr3_en)==0)
+        return 0;
+    for(int ch=1;ch<8;ch++)
+        if(sim_dma[ch].en && sim_dma[ch].from_mem==from_mem && dma_usart(ch)==u)
+            return ch;
+    return 0;
+}
+
+/* One received byte through the circular DMA channel, PRIMASK held */
+static void usart_rx_dma(uint8_t ch, uint8_t byte){
+    struct sim_dma *d=&sim_dma[ch];
+    uint16_t left=sim_dma_cndtr[ch];
+    ((uint8_t *)(uintptr_t)d->maddr)[d->size-left]=byte;
+    sim_dma_cndtr[ch]=--left;
+    if(left==d->size/2){
+        dma_raise(ch, DMA_HTIF, d->htie);
+        sim_irq_sync(NVIC_DMA1_CHANNEL1_IRQ+ch-1);
+    }else if(left==0){
+        if(d->circ)
+            sim_dma_cndtr[ch]=d->size;
+        else
+            d->en=0;
+        dma_raise(ch, DMA_TCIF, d->tcie);
+        sim_irq_sync(NVIC_DMA1_CHANNEL1_IRQ+ch-1);
+    }
+}
+
+/* One received byte through DR, waiting for the previous one to be read */
+static void usart_rx_byte(int u, uint8_t byte){
+    struct sim_usart_regs *r=&sim_usart_regs[u];
+    while(r->sr&USART_SR_RXNE)
+        sim_wait(&sim_usart[u].rx_cond, NULL);
+    r->dr=byte;
+    r->sr|=USART_SR_RXNE;
+    if(r->cr1&USART_CR1_RXNEIE){
+        sim_irq_raise(NVIC_USART1_IRQ+u-1);
+        sim_irq_sync(NVIC_USART1_IRQ+u-1);
+    }
+}
+
+static void *usart_rx_thread(void *arg){
+    int u=(intptr_t)arg;
+    struct sim_usart_regs *r=&sim_usart_regs[u];
+    uint8_t buf[64];
+    while(1){
+        ssize_t n=read(sim_usart[u].fd, buf, sizeof(buf));
+        if(n<=0){
+            if(n<0 && errno==EINTR)
+                continue;
+            break;
+        }
+        cm_mask_interrupts(true);
+        for(ssize_t i=0;i<n;i++){
+            int ch=usart_channel(u, 0, USART_CR3_DMAR);
+            if(ch)
+                usart_rx_dma(ch, buf[i]);
+            else if(r->cr1&USART_CR1_UE)
+                usart_rx_byte(u, buf[i]);
+        }
+        /* the line goes idle after every burst the host wrote */
+        r->sr|=USART_SR_IDLE;
+        if(r->cr1&USART_CR1_IDLEIE){
+            sim_irq_raise(NVIC_USART1_IRQ+u-1);
+            sim_irq_sync(NVIC_USART1_IRQ+u-1);
+        }
+        cm_mask_interrupts(false);
+    }
+    return NULL;
+}
+
+/* Sends whatever an armed memory-to-peripheral channel holds */
+static void *usart_tx_thread(void *arg){
+    int u=(intptr_t)arg;
+    uint8_t buf[1024];
+    cm_mask_interrupts(true);
+    while(1){
+        int ch=usart_channel(u, 1, USART_CR3_DMAT);
+        if(ch==0 || sim_dma_cndtr[ch]==0){
+            sim_wait(&sim_usart[u].tx_cond, NULL);
+            continue;
+        }
+        struct sim_dma *d=&sim_dma[ch];
+        size_t n=sim_dma_cndtr[ch];
+        if(n>sizeof(buf))
+            n=sizeof(buf);
+        memcpy(buf, (uint8_t *)(uintptr_t)d->maddr+d->size-sim_dma_cndtr[ch], n);
+        cm_mask_interrupts(false);
+        for(size_t off=0;off<n;){
+            ssize_t w=write(sim_usart[u].fd, buf+off, n-off);
+            if(w<0 && errno!=EINTR)
+                break;
+            if(w>0)
+                off+=w;
+        }
+        cm_mask_interrupts(true);
+        sim_dma_cndtr[ch]-=n;
+        if(sim_dma_cndtr[ch]==0){
+            d->en=0;
+            dma_raise(ch, DMA_TCIF, d->tcie);
+        }
+    }
+    return NULL;
+}
+
+static void usart_open(int u){
+    struct sim_usart *s=&sim_usart[u];
+    struct termios tio;
+    char name[8];
+    int slave;
+
+    s->fd=posix_openpt(O_RDWR|O_NOCTTY);
+    if(s->fd<0 || grantpt(s->fd)<0 || unlockpt(s->fd)<0)
+        goto fail;
+    slave=open(ptsname(s->fd), O_RDWR|O_NOCTTY);
+    if(slave<0 || tcgetattr(slave, &tio)<0)
+        goto fail;
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    snprintf(name, sizeof(name), "uart%d", u);
+    const char *link=sim_path(name);
+    unlink(link);
+    if(symlink(ptsname(s->fd), link)<0)
+        goto fail;
+    fprintf(stderr, "sim: USART%d on %s (%s)\n", u, ptsname(s->fd), link);
+
+    sim_cond_init(&s->rx_cond);
+    sim_cond_init(&s->tx_cond);
+    if(pthread_create(&s->rx, NULL, usart_rx_thread, (void *)(intptr_t)u)!=0 ||
+            pthread_create(&s->tx, NULL, usart_tx_thread, (void *)(intptr_t)u)!=0)
+        goto fail;
+    return;
+fail:
+    perror("sim: usart");
+    exit(1);
+}
+
+void usart_set_baudrate(uint32_t usart __unused, uint32_t baud __unused){
+}
+
+void usart_set_databits(uint32_t usart __unused, uint32_t bits __unused){
+}
+
+void usart_set_parity(uint32_t usart __unused, uint32_t parity __unused){
+}
+
+void usart_set_stopbits(uint32_t usart __unused, uint32_t stopbits __unused){
+}
+
+void usart_set_flow_control(uint32_t usart __unused, uint32_t flowcontrol __unused){
+}
+
+void usart_set_mode(uint32_t usart __unused, uint32_t mode __unused){
+}
+
+void usart_enable(uint32_t usart){
+    if(sim_usart[usart].fd<0)
+        usart_open(usart);
+    sim_usart_regs[usart].cr1|=USART_CR1_UE;
+}
+
+void usart_enable_rx_dma(uint32_t usart){
+    sim_usart_regs[usart].cr3|=USART_CR3_DMAR;
+}
+
+void usart_enable_tx_dma(uint32_t usart){
+    bool m=cm_mask_interrupts(true);
+    sim_usart_regs[usart].cr3|=USART_CR3_DMAT;
+    usart_kick(usart);
+    cm_mask_interrupts(m);
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data){
+    uint8_t byte=data;
+    if(sim_usart[usart].fd>=0)
+        (void)!write(sim_usart[usart].fd, &byte, 1);
+}
+
+uint16_t usart_recv(uint32_t usart){
+    return *sim_usart_dr(usart);
+}
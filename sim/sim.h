@@ -0,0 +1,53 @@
+#ifndef SIM_H_INCLUDED
+#define SIM_H_INCLUDED
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Glue between the pieces of the host simulator.
+ *
+ * core.c   - PRIMASK, NVIC dispatch, WFI, DWT cycle counter
+ * kernel.c - atomthreads on pthreads
+ * periph.c - RCC, GPIO, EXTI, USART and DMA1, the USARTs on ptys
+ * usbd.c   - libopencm3 usbd on a unix seqpacket socket
+ *
+ * Everything that touches simulated hardware state holds the PRIMASK
+ * lock, the firmware by its critical sections and ISRs, the device
+ * threads by taking it themselves.
+ *
+ *   make host-sim
+ *   SIM_DIR=/tmp ./usbmidi-sim &
+ *   ./usbsock /tmp/usb.sock          USB host, see tools/usbsock.c
+ *   cat /tmp/uart2 | od -tx1         MIDI out of the first port
+ */
+
+extern pthread_mutex_t sim_primask;
+
+/* Monotonic nanoseconds since start */
+uint64_t sim_now_ns(void);
+/* Absolute CLOCK_MONOTONIC time ticks system ticks from now */
+void sim_deadline(struct timespec *ts, uint32_t ticks);
+/* Condition variable on the monotonic clock for sim_wait */
+void sim_cond_init(pthread_cond_t *cond);
+/*
+ * Caller holds PRIMASK; it is released while waiting, like WFI with
+ * interrupts masked. deadline NULL waits forever, returns ETIMEDOUT
+ * when it passed.
+ */
+int sim_wait(pthread_cond_t *cond, const struct timespec *deadline);
+
+/* Set an interrupt pending, any context */
+void sim_irq_raise(int irqn);
+/*
+ * Caller holds PRIMASK: wait until the ISR of an enabled irqn has run.
+ * Device threads feeding data use it so the firmware keeps up with a
+ * host that is faster than the wire.
+ */
+void sim_irq_sync(int irqn);
+
+/* $SIM_DIR/name, where the device links and the USB socket go */
+const char *sim_path(const char *name);
+
+#endif
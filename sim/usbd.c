@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/usb/usbd.h>
+
+#include "sim.h"
+#include "usb_dblbuf.h"
+
+/*
+ * USB device on a unix seqpacket socket at $SIM_DIR/usb.sock, one host
+ * at a time. Connecting is enumeration: the set-config callback runs
+ * from the next usbd_poll. Each message is one bulk packet, the
+ * endpoint address followed by the payload: the host sends OUT packets
+ * to 0x01.., the device sends IN packets from 0x8N. Control transfers
+ * beyond SET_CONFIGURATION are not modelled; its completion reaches the
+ * host as an empty 0x80 message, ahead of any IN packet.
+ */
+
+#define SIM_EPS 8
+#define SIM_EP_SIZE 64
+
+struct _usbd_driver {
+    const char *name;
+};
+const usbd_driver st_usbfs_v1_usb_driver={ .name="sim" };
+
+struct sim_ep {
+    usbd_endpoint_callback cb;
+    uint16_t len;
+    uint8_t buf[SIM_EP_SIZE];
+    uint8_t full;   //OUT - not read yet, IN - not sent yet
+    uint8_t event;  //callback due at the next usbd_poll
+    uint8_t nak;    //OUT only
+};
+
+struct _usbd_device {
+    usbd_set_config_callback set_config;
+    usbd_control_callback control;
+    struct sim_ep out[SIM_EPS], in[SIM_EPS];
+    uint8_t configure;      //host connected, set_config pending
+    uint8_t configured;
+    uint8_t announce;       //the host is yet to learn it is configured
+    int client;
+    pthread_cond_t out_cond;    //an OUT endpoint took its packet
+    pthread_cond_t in_cond;     //an IN endpoint got one, or a host came
+    pthread_t rx, tx;
+};
+static struct _usbd_device sim_usbd={ .client=-1 };
+
+static void usbd_raise(void){
+    sim_irq_raise(NVIC_USB_LP_CAN_RX0_IRQ);
+}
+
+/* Host to device, PRIMASK held: waits while the endpoint holds or NAKs */
+static void usbd_out(usbd_device *dev, uint8_t *msg, ssize_t n){
+    struct sim_ep *ep=&dev->out[msg[0]&(SIM_EPS-1)];
+    if(msg[0]&0x80 || n-1>SIM_EP_SIZE)
+        return;
+    while(dev->client>=0 && (!dev->configured || ep->full || ep->nak))
+        sim_wait(&dev->out_cond, NULL);
+    if(ep->cb==NULL)
+        return;
+    memcpy(ep->buf, msg+1, n-1);
+    ep->len=n-1;
+    ep->full=1;
+    ep->event=1;
+    usbd_raise();
+}
+
+static void *usbd_rx_thread(void *arg){
+    usbd_device *dev=arg;
+    struct sockaddr_un addr={ .sun_family=AF_UNIX };
+    uint8_t msg[1+SIM_EP_SIZE+1];
+    const char *path=sim_path("usb.sock");
+    int fd=socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+    if(fd<0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr))<0 || listen(fd, 1)<0){
+        perror("sim: usb");
+        exit(1);
+    }
+    fprintf(stderr, "sim: USB on %s\n", path);
+    while(1){
+        int client=accept(fd, NULL, NULL);
+        if(client<0)
+            continue;
+        cm_mask_interrupts(true);
+        dev->client=client;
+        dev->configure=1;
+        pthread_cond_broadcast(&dev->in_cond);
+        usbd_raise();
+        cm_mask_interrupts(false);
+
+        ssize_t n;
+        while((n=recv(client, msg, sizeof(msg), 0))>0 || (n<0 && errno==EINTR)){
+            if(n<=0)
+                continue;
+            cm_mask_interrupts(true);
+            usbd_out(dev, msg, n);
+            cm_mask_interrupts(false);
+        }
+
+        /* unplugged: the next host enumerates again */
+        cm_mask_interrupts(true);
+        dev->client=-1;
+        dev->configured=0;
+        pthread_cond_broadcast(&dev->out_cond);
+        cm_mask_interrupts(false);
+        close(client);
+    }
+    return NULL;
+}
+
+/* Device to host: sends what the IN endpoints were given */
+static void *usbd_tx_thread(void *arg){
+    usbd_device *dev=arg;
+    uint8_t msg[1+SIM_EP_SIZE];
+    cm_mask_interrupts(true);
+    while(1){
+        int i=0;
+        if(dev->configured && dev->announce){
+            int client=dev->client;
+            dev->announce=0;
+            msg[0]=0x80;
+            cm_mask_interrupts(false);
+            send(client, msg, 1, MSG_NOSIGNAL);
+            cm_mask_interrupts(true);
+            continue;
+        }
+        if(dev->configured)
+            for(i=1;i<SIM_EPS && !dev->in[i].full;i++);
+        if(i==0 || i==SIM_EPS){
+            sim_wait(&dev->in_cond, NULL);
+            continue;
+        }
+        struct sim_ep *ep=&dev->in[i];
+        int client=dev->client;
+        size_t n=ep->len;
+        msg[0]=0x80|i;
+        memcpy(msg+1, ep->buf, n);
+        cm_mask_interrupts(false);
+        ssize_t w=send(client, msg, 1+n, MSG_NOSIGNAL);
+        cm_mask_interrupts(true);
+        if(w<0 && dev->client==client)
+            continue; //retried until the reader notices the hangup
+        ep->full=0;
+        if(ep->cb){
+            ep->event=1;
+            usbd_raise();
+        }
+    }
+    return NULL;
+}
+
+usbd_device *usbd_init(const usbd_driver *driver __unused,
+        const struct usb_device_descriptor *dev __unused,
+        const struct usb_config_descriptor *conf __unused,
+        const char **strings __unused, int num_strings __unused,
+        uint8_t *control_buffer __unused, uint16_t control_buffer_size __unused){
+    usbd_device *d=&sim_usbd;
+    sim_cond_init(&d->out_cond);
+    sim_cond_init(&d->in_cond);
+    if(pthread_create(&d->rx, NULL, usbd_rx_thread, d)!=0 ||
+            pthread_create(&d->tx, NULL, usbd_tx_thread, d)!=0)
+        abort();
+    return d;
+}
+
+/* From the USB ISR, PRIMASK held */
+void usbd_poll(usbd_device *dev){
+    if(dev->configure){
+        dev->configure=0;
+        if(dev->set_config)
+            dev->set_config(dev, 1);
+        dev->configured=1;
+        dev->announce=1;
+        pthread_cond_broadcast(&dev->out_cond);
+        pthread_cond_broadcast(&dev->in_cond);
+    }
+    for(int i=0;i<SIM_EPS;i++){
+        if(dev->out[i].event){
+            dev->out[i].event=0;
+            dev->out[i].cb(dev, i);
+        }
+        if(dev->in[i].event){
+            dev->in[i].event=0;
+            dev->in[i].cb(dev, 0x80|i);
+        }
+    }
+}
+
+void usbd_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type __unused,
+        uint16_t max_size __unused, usbd_endpoint_callback callback){
+    struct sim_ep *ep=addr&0x80?&dev->in[addr&(SIM_EPS-1)]:&dev->out[addr&(SIM_EPS-1)];
+    memset(ep, 0, sizeof(*ep));
+    ep->cb=callback;
+}
+
+uint16_t usbd_ep_write_packet(usbd_device *dev, uint8_t addr,
+        const void *buf, uint16_t len){
+    struct sim_ep *ep=&dev->in[addr&(SIM_EPS-1)];
+    bool m=cm_mask_interrupts(true);
+    if(ep->full || len>SIM_EP_SIZE){
+        cm_mask_interrupts(m);
+        return 0;
+    }
+    memcpy(ep->buf, buf, len);
+    ep->len=len;
+    ep->full=1;
+    pthread_cond_broadcast(&dev->in_cond);
+    cm_mask_interrupts(m);
+    return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device *dev, uint8_t addr,
+        void *buf, uint16_t len){
+    struct sim_ep *ep=&dev->out[addr&(SIM_EPS-1)];
+    bool m=cm_mask_interrupts(true);
+    if(!ep->full){
+        cm_mask_interrupts(m);
+        return 0;
+    }
+    if(len>ep->len)
+        len=ep->len;
+    if(buf)
+        memcpy(buf, ep->buf, len);
+    ep->full=0;
+    pthread_cond_broadcast(&dev->out_cond);
+    cm_mask_interrupts(m);
+    return len;
+}
+
+void usbd_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak){
+    if(addr&0x80)
+        return;
+    dev->out[addr&(SIM_EPS-1)].nak=nak;
+    if(!nak)
+        pthread_cond_broadcast(&dev->out_cond);
+}
+
+/* usb_dblbuf.h: the packet is in the endpoint, not read yet */
+int usb_ep_out_pending(uint8_t ep){
+    return sim_usbd.out[ep&(SIM_EPS-1)].full;
+}
+
+int usbd_register_control_callback(usbd_device *dev, uint8_t type __unused,
+        uint8_t type_mask __unused, usbd_control_callback callback){
+    dev->control=callback;
+    return 0;
+}
+
+int usbd_register_set_config_callback(usbd_device *dev,
+        usbd_set_config_callback callback){
+    dev->set_config=callback;
+    return 0;
+}
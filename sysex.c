@@ -0,0 +1,44 @@
+#include "sysex.h"
+
+static enum sysex_result sysex_end(struct sysex_stream *sx, struct sysex_stats *st,
+        uint32_t now){
+    sx->active=0;
+    st->messages++;
+    st->last_bytes=sx->len;
+    st->last_ticks=now-sx->start;
+    if(sx->len==6 && sx->head[1]==0x7e && sx->head[3]==0x06 && sx->head[4]==0x01)
+        return SYSEX_IDENTITY_REQUEST;
+    return SYSEX_END;
+}
+
+/* Follow n MIDI bytes, returns what the last 0xf7 among them ended */
+enum sysex_result sysex_feed(struct sysex_stream *sx, struct sysex_stats *st,
+        const uint8_t *b, uint8_t n, uint32_t now){
+    enum sysex_result res=SYSEX_NONE;
+    while(n--){
+        uint8_t c=*b++;
+        if(c>=0xf8) //realtime may appear inside sysex
+            continue;
+        if(c==0xf0){
+            if(sx->active)
+                st->aborted++;
+            sx->active=1;
+            sx->hlen=0;
+            sx->len=0;
+            sx->start=now;
+        }else if(!sx->active){
+            continue;
+        }else if(c&0x80 && c!=0xf7){
+            sx->active=0;
+            st->aborted++;
+            continue;
+        }
+        if(sx->hlen<SYSEX_HEAD)
+            sx->head[sx->hlen++]=c;
+        sx->len++;
+        st->bytes++;
+        if(c==0xf7)
+            res=sysex_end(sx, st, now);
+    }
+    return res;
+}
@@ -0,0 +1,40 @@
+#ifndef SYSEX_H_INCLUDED
+#define SYSEX_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Streaming SysEx follower. Messages of any length pass through a byte
+ * at a time and are never buffered whole; only the first SYSEX_HEAD
+ * bytes are kept to recognise requests addressed to this device.
+ * Segmenting into USB-MIDI events is midi_parse's job.
+ */
+#define SYSEX_HEAD 6
+
+struct sysex_stream {
+    uint8_t active;
+    uint8_t hlen;               //bytes in head
+    uint8_t head[SYSEX_HEAD];
+    uint32_t len;
+    uint32_t start;             //tick of the 0xf0
+};
+
+struct sysex_stats {
+    uint32_t messages;          //ended by 0xf7
+    uint32_t aborted;           //cut short by another status byte
+    uint32_t dropped;           //events lost for lack of room
+    uint32_t bytes;
+    uint32_t last_bytes;        //last complete message: its length
+    uint32_t last_ticks;        //and the ticks from 0xf0 to 0xf7
+};
+
+enum sysex_result {
+    SYSEX_NONE,
+    SYSEX_END,                  //a message ended
+    SYSEX_IDENTITY_REQUEST      //it was F0 7E <dev> 06 01 F7
+};
+
+enum sysex_result sysex_feed(struct sysex_stream *sx, struct sysex_stats *st,
+        const uint8_t *b, uint8_t n, uint32_t now);
+
+#endif
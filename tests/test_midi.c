@@ -0,0 +1,204 @@
+/*
+ * Unit test of midi.c against the MIDI 1.0 and USB-MIDI 1.0 specs.
+ *
+ * Every one of the 256 byte values is classified the way the specs put
+ * it, written out here message by message rather than derived from the
+ * table, and compared with midi_class_table: length, CIN, realtime,
+ * sysex role, status and undefined.
+ *
+ * A fixed corpus of streams with realtime bytes cut into messages, SysEx
+ * and running status goes through midi_parse and midi_parse_stamped,
+ * whole, a byte per call and with room for one event per call, and must
+ * give exactly the events and stamps listed.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "midi.h"
+
+struct spec {
+    uint8_t len;        //bytes with status, 0: none of its own
+    uint8_t cin;
+    uint8_t rt;
+    uint8_t sx;         //MIDI_SX_*
+    uint8_t status;
+    uint8_t undef;
+};
+
+/* MIDI 1.0 table I/II/III, CINs from USB-MIDI 1.0 table 4-1 */
+static struct spec spec_of(uint8_t b){
+    struct spec s={ .status=b>=0x80 };
+    if(b<0x80)
+        return s;                       //data byte
+    if(b<0xf0){                         //channel voice
+        static const uint8_t len[8]={ 3, 3, 3, 3, 2, 2, 3 };
+        s.len=len[(b>>4)-8];
+        s.cin=b>>4;
+        return s;
+    }
+    switch(b){
+        case 0xf0: s.cin=0x4; s.sx=MIDI_SX_START; break;   //SysEx starts or continues
+        case 0xf1: s.len=2; s.cin=0x2; break;   //MTC quarter frame
+        case 0xf2: s.len=3; s.cin=0x3; break;   //song position pointer
+        case 0xf3: s.len=2; s.cin=0x2; break;   //song select
+        case 0xf4: case 0xf5: s.undef=1; break;
+        case 0xf6: s.len=1; s.cin=0x5; break;   //tune request, single byte common
+        case 0xf7: s.cin=0x5; s.sx=MIDI_SX_END; break;     //EOX alone
+        case 0xf9: case 0xfd: s.rt=1; s.undef=1; break;
+        default: s.len=1; s.cin=0xf; s.rt=1; break;        //F8 FA FB FC FE FF
+    }
+    return s;
+}
+
+static void test_class_table(void){
+    for(int b=0;b<256;b++){
+        struct spec s=spec_of(b);
+        uint16_t c=midi_class(b);
+        if(midi_len(c)!=s.len || midi_cin(c)!=s.cin || !(c&MIDI_RT)!=!s.rt ||
+                (c&MIDI_SX_MASK)!=s.sx || !(c&MIDI_STATUS)!=!s.status ||
+                !(c&MIDI_UNDEF)!=!s.undef){
+            fprintf(stderr, "0x%02x: class 0x%04x, spec len %u cin %x rt %u sx %u status %u undef %u\n",
+                    b, c, s.len, s.cin, s.rt, s.sx, s.status, s.undef);
+            assert(0);
+        }
+        assert((c&~(MIDI_LEN_MASK|MIDI_RT|MIDI_SX_MASK|MIDI_STATUS|MIDI_UNDEF|
+                0x0f<<MIDI_CIN_SHIFT))==0);
+        if(s.len)                       //an event carries the whole message
+            assert(midi_cin_bytes(midi_cin(c))==s.len);
+    }
+}
+
+/* USB-MIDI 1.0 table 4-1 */
+static void test_cin_len(void){
+    static const uint8_t len[16]={
+        [0x2]=2, [0x3]=3, [0x4]=3, [0x5]=1, [0x6]=2, [0x7]=3,
+        [0x8]=3, [0x9]=3, [0xa]=3, [0xb]=3, [0xc]=2, [0xd]=2, [0xe]=3, [0xf]=1,
+    };
+    for(int cin=0;cin<16;cin++)
+        assert(midi_cin_bytes(cin)==len[cin]);
+    //EOX after 0, 1 or 2 sysex bytes: CIN 5, 6, 7
+    for(int n=0;n<3;n++)
+        assert(midi_cin_bytes(midi_cin(midi_class(0xf7))+n)==n+1);
+}
+
+#define CABLE 5
+#define EV(cin, b1, b2, b3) { CABLE<<4|(cin), b1, b2, b3 }
+
+struct corpus {
+    const char *name;
+    uint8_t in[16];
+    uint8_t len;
+    uint8_t ev[8][4];
+    uint8_t stamp[8];       //offset of the event's first byte
+    uint8_t events;
+};
+
+static const struct corpus corpus[]={
+    { "F8 in sysex, between events",
+        { 0xf0, 0x01, 0x02, 0xf8, 0x03, 0x04, 0xf7 }, 7,
+        { EV(0x4, 0xf0, 0x01, 0x02), EV(0xf, 0xf8, 0, 0), EV(0x7, 0x03, 0x04, 0xf7) },
+        { 0, 3, 4 }, 3 },
+    { "F8 in sysex, inside an event",
+        { 0xf0, 0x01, 0xf8, 0x02, 0x03, 0xf7 }, 6,
+        { EV(0xf, 0xf8, 0, 0), EV(0x4, 0xf0, 0x01, 0x02), EV(0x6, 0x03, 0xf7, 0) },
+        { 2, 0, 4 }, 3 },
+    { "F8 between the data bytes of a note",
+        { 0x90, 0x3c, 0xf8, 0x64 }, 4,
+        { EV(0xf, 0xf8, 0, 0), EV(0x9, 0x90, 0x3c, 0x64) },
+        { 2, 0 }, 2 },
+    { "F8 before running status",
+        { 0x90, 0x3c, 0x64, 0xf8, 0x3e, 0x64 }, 6,
+        { EV(0x9, 0x90, 0x3c, 0x64), EV(0xf, 0xf8, 0, 0), EV(0x9, 0x90, 0x3e, 0x64) },
+        { 0, 3, 4 }, 3 },
+    { "F8 inside running status",
+        { 0x90, 0x3c, 0x64, 0x3e, 0xf8, 0x64 }, 6,
+        { EV(0x9, 0x90, 0x3c, 0x64), EV(0xf, 0xf8, 0, 0), EV(0x9, 0x90, 0x3e, 0x64) },
+        { 0, 4, 3 }, 3 },
+    { "FE inside a CC",
+        { 0xb0, 0x07, 0xfe, 0x7f }, 4,
+        { EV(0xf, 0xfe, 0, 0), EV(0xb, 0xb0, 0x07, 0x7f) },
+        { 2, 0 }, 2 },
+    { "FF inside a program change",
+        { 0xc0, 0xff, 0x05 }, 3,
+        { EV(0xf, 0xff, 0, 0), EV(0xc, 0xc0, 0x05, 0) },
+        { 1, 0 }, 2 },
+    { "FE and FF around a pitch bend byte",
+        { 0xe0, 0xfe, 0x00, 0xff, 0x40 }, 5,
+        { EV(0xf, 0xfe, 0, 0), EV(0xf, 0xff, 0, 0), EV(0xe, 0xe0, 0x00, 0x40) },
+        { 1, 3, 0 }, 3 },
+    { "FF and FE in sysex",
+        { 0xf0, 0x7d, 0xff, 0x01, 0xfe, 0xf7 }, 6,
+        { EV(0xf, 0xff, 0, 0), EV(0x4, 0xf0, 0x7d, 0x01), EV(0xf, 0xfe, 0, 0),
+          EV(0x5, 0xf7, 0, 0) },
+        { 2, 0, 4, 5 }, 4 },
+    { "F8 in a song position, no running status after",
+        { 0xf2, 0x01, 0xf8, 0x02, 0x03 }, 5,
+        { EV(0xf, 0xf8, 0, 0), EV(0x3, 0xf2, 0x01, 0x02) },
+        { 2, 0 }, 2 },
+    { "undefined realtime F9 and FD ignored",
+        { 0x90, 0x3c, 0xf9, 0x64, 0xfd }, 5,
+        { EV(0x9, 0x90, 0x3c, 0x64) },
+        { 0 }, 1 },
+};
+
+enum split { WHOLE, BYTES, ONE_EVENT, SPLITS };
+
+/* Events and stamps of the stream, cut up as split says */
+static uint16_t parse(const struct corpus *c, enum split split, int stamped,
+        uint32_t *ev, uint32_t *stamps){
+    struct midi_parser mp={ .cable=CABLE };
+    uint16_t off=0, total=0;
+    while(off<c->len){
+        uint16_t len=split==BYTES?1:c->len-off;
+        uint16_t max=split==ONE_EVENT?1:8, n, used;
+        if(stamped)
+            used=midi_parse_stamped(&mp, c->in+off, len, off, 1, ev+total,
+                    stamps+total, max, &n);
+        else
+            used=midi_parse(&mp, c->in+off, len, ev+total, max, &n);
+        assert(used>0 && used<=len);
+        assert(used==len || n==max);
+        off+=used;
+        total+=n;
+        assert(total<=8);
+    }
+    return total;
+}
+
+static void test_corpus(void){
+    for(unsigned i=0;i<sizeof(corpus)/sizeof(corpus[0]);i++){
+        const struct corpus *c=&corpus[i];
+        for(int split=0;split<SPLITS;split++)
+            for(int stamped=0;stamped<2;stamped++){
+                uint32_t ev[8], stamps[8];
+                uint16_t n=parse(c, split, stamped, ev, stamps);
+                int ok=n==c->events;
+                for(uint16_t k=0;ok && k<n;k++)
+                    ok=memcmp(&ev[k], c->ev[k], 4)==0 &&
+                        (!stamped || stamps[k]==c->stamp[k]);
+                if(!ok){
+                    fprintf(stderr, "%s, split %d%s:", c->name, split,
+                            stamped?", stamped":"");
+                    for(uint16_t k=0;k<n;k++){
+                        uint8_t b[4];
+                        memcpy(b, &ev[k], 4);
+                        fprintf(stderr, " %02x %02x %02x %02x", b[0], b[1], b[2], b[3]);
+                        if(stamped)
+                            fprintf(stderr, "@%u", stamps[k]);
+                    }
+                    fprintf(stderr, "\n");
+                    assert(0);
+                }
+            }
+    }
+}
+
+int main(void){
+    test_class_table();
+    test_cin_len();
+    test_corpus();
+    printf("midi: class table, %u streams ok\n", (unsigned)(sizeof(corpus)/sizeof(corpus[0])));
+    return 0;
+}
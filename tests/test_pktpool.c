@@ -0,0 +1,137 @@
+/*
+ * Unit test of the packet pool (pktpool.c): allocation until exhausted,
+ * release in any order, the high-water mark and the free count the USB
+ * OUT NAK decision is taken on.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atom.h>
+
+#include "pktpool.h"
+
+/* Single threaded, nothing to mask */
+bool cm_mask_interrupts(bool mask __unused){
+    return false;
+}
+
+static struct pkt *held[PKT_POOL_BLOCKS];
+
+/* Every block held is whole and apart from the others */
+static void check_held(unsigned n){
+    for(unsigned i=0;i<n;i++){
+        memset(held[i]->data, i, PKT_SIZE);
+        memset(held[i]->stamp, i, sizeof(held[i]->stamp));
+        held[i]->len=i;
+    }
+    for(unsigned i=0;i<n;i++){
+        assert(held[i]->len==i);
+        for(unsigned k=0;k<PKT_SIZE;k++)
+            assert(held[i]->data[k]==i);
+        assert(((uintptr_t)held[i]->data&3)==0);
+    }
+}
+
+static void test_exhaust(void){
+    pkt_pool_init();
+    assert(pkt_pool_free()==PKT_POOL_BLOCKS);
+    assert(pkt_pool_stats.max_used==0 && pkt_pool_stats.alloc_fail==0);
+    for(unsigned i=0;i<PKT_POOL_BLOCKS;i++){
+        held[i]=pkt_alloc();
+        assert(held[i]!=NULL);
+        for(unsigned k=0;k<i;k++)
+            assert(held[k]!=held[i]);
+        assert(pkt_pool_free()==PKT_POOL_BLOCKS-1-i);
+        assert(pkt_pool_stats.max_used==i+1);
+    }
+    check_held(PKT_POOL_BLOCKS);
+    assert(pkt_alloc()==NULL);
+    assert(pkt_alloc()==NULL);
+    assert(pkt_pool_stats.alloc_fail==2);
+    assert(pkt_pool_free()==0);
+    assert(pkt_pool_stats.max_used==PKT_POOL_BLOCKS);
+}
+
+/* Freed in an odd order, the blocks come back last freed first */
+static void test_free_order(void){
+    static const uint8_t order[]={ 3, 0, 7, 5, 1, 6, 2, 4 };
+    _Static_assert(sizeof(order)==PKT_POOL_BLOCKS, "one entry per block");
+    struct pkt *freed[PKT_POOL_BLOCKS];
+    for(unsigned i=0;i<PKT_POOL_BLOCKS;i++){
+        freed[i]=held[order[i]];
+        pkt_free(freed[i]);
+        assert(pkt_pool_free()==i+1);
+    }
+    assert(pkt_pool_stats.max_used==PKT_POOL_BLOCKS);   //a mark, not a level
+    for(unsigned i=0;i<PKT_POOL_BLOCKS;i++){
+        held[i]=pkt_alloc();
+        assert(held[i]==freed[PKT_POOL_BLOCKS-1-i]);
+    }
+    check_held(PKT_POOL_BLOCKS);
+    for(unsigned i=0;i<PKT_POOL_BLOCKS;i++)
+        pkt_free(held[i]);
+    assert(pkt_pool_free()==PKT_POOL_BLOCKS);
+}
+
+static void test_high_water(void){
+    pkt_pool_init();
+    for(unsigned i=0;i<3;i++)
+        held[i]=pkt_alloc();
+    pkt_free(held[1]);
+    held[1]=pkt_alloc();
+    assert(pkt_pool_stats.max_used==3);
+    held[3]=pkt_alloc();
+    assert(pkt_pool_stats.max_used==4);
+    for(unsigned i=0;i<4;i++)
+        pkt_free(held[i]);
+    assert(pkt_pool_stats.max_used==4);
+    assert(pkt_pool_stats.alloc_fail==0);
+    pkt_pool_init();
+    assert(pkt_pool_stats.max_used==0);
+}
+
+/*
+ * A random walk of allocations and releases: the free count, which
+ * usbmidi.c NAKs USB OUT on, is always the blocks not held.
+ */
+static void test_free_count(void){
+    uint32_t s=1, fails=0;
+    unsigned n=0, peak=0;
+    pkt_pool_init();
+    for(int step=0;step<100000;step++){
+        s=s*1103515245+12345;
+        if((s>>16)&1){
+            struct pkt *p=pkt_alloc();
+            if(n==PKT_POOL_BLOCKS){
+                assert(p==NULL);
+                fails++;
+            }else{
+                assert(p!=NULL);
+                held[n++]=p;
+            }
+        }else if(n){
+            unsigned i=(s>>17)%n;
+            pkt_free(held[i]);
+            held[i]=held[--n];
+        }
+        if(n>peak)
+            peak=n;
+        assert(pkt_pool_free()==PKT_POOL_BLOCKS-n);
+        assert(pkt_pool_stats.max_used==peak);
+        assert(pkt_pool_stats.alloc_fail==fails);
+    }
+    check_held(n);
+    while(n)
+        pkt_free(held[--n]);
+    assert(pkt_pool_free()==PKT_POOL_BLOCKS);
+}
+
+int main(void){
+    test_exhaust();
+    test_free_order();
+    test_high_water();
+    test_free_count();
+    printf("pktpool: %u blocks ok\n", PKT_POOL_BLOCKS);
+    return 0;
+}
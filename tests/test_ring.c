@@ -0,0 +1,143 @@
+/*
+ * Two thread stress test of the SPSC ring (ring.h).
+ *
+ * A producer and a consumer thread move a known byte sequence through
+ * rings of several sizes, each side switching at random between the span
+ * calls (reserve/commit, peek/consume, taking part of the span) and
+ * ring_write/ring_read. The consumer checks every byte and the fill level
+ * seen from both sides. Built with -fsanitize=thread, a data copy not
+ * ordered by the index stores shows up as a race on the storage.
+ *
+ * test_ring [-n bytes]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+struct stress {
+    struct ring ring;
+    uint16_t size;
+    uint32_t bytes;
+};
+
+static uint8_t seq_byte(uint32_t i){
+    return (uint8_t)(i^(i>>8)^(i>>16));
+}
+
+/* xorshift, one state per thread */
+static uint32_t rnd(uint32_t *s){
+    *s^=*s<<13;
+    *s^=*s>>17;
+    *s^=*s<<5;
+    return *s;
+}
+
+static void *producer(void *arg){
+    struct stress *st=arg;
+    struct ring *r=&st->ring;
+    uint32_t s=0x12345678, i=0;
+    uint8_t chunk[512];
+    while(i<st->bytes){
+        uint32_t left=st->bytes-i;
+        if(rnd(&s)&1){
+            uint8_t *p;
+            uint16_t n=ring_reserve(r, &p);
+            assert(n<=st->size);
+            if(n==0){
+                sched_yield();  //one CPU is enough for the test
+                continue;
+            }
+            n=1+rnd(&s)%n;      //fill part of the span only
+            if(n>left)
+                n=left;
+            for(uint16_t k=0;k<n;k++)
+                p[k]=seq_byte(i+k);
+            ring_commit(r, n);
+            i+=n;
+        }else{
+            uint16_t len=1+rnd(&s)%sizeof(chunk);
+            if(len>left)
+                len=left;
+            for(uint16_t k=0;k<len;k++)
+                chunk[k]=seq_byte(i+k);
+            uint16_t n=ring_write(r, chunk, len);
+            if(n==0)
+                sched_yield();
+            i+=n;
+        }
+        assert(ring_used(r)<=st->size);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg){
+    struct stress *st=arg;
+    struct ring *r=&st->ring;
+    uint32_t s=0x9abcdef0, i=0;
+    uint8_t chunk[512];
+    while(i<st->bytes){
+        if(rnd(&s)&1){
+            uint8_t *p;
+            uint16_t n=ring_peek(r, &p);
+            assert(n<=st->size);
+            if(n==0){
+                sched_yield();  //one CPU is enough for the test
+                continue;
+            }
+            n=1+rnd(&s)%n;      //take part of the span only
+            for(uint16_t k=0;k<n;k++)
+                assert(p[k]==seq_byte(i+k));
+            ring_consume(r, n);
+            i+=n;
+        }else{
+            uint16_t n=ring_read(r, chunk, 1+rnd(&s)%sizeof(chunk));
+            if(n==0)
+                sched_yield();
+            for(uint16_t k=0;k<n;k++)
+                assert(chunk[k]==seq_byte(i+k));
+            i+=n;
+        }
+        assert(ring_free(r)<=st->size);
+    }
+    return NULL;
+}
+
+static void stress(uint16_t size, uint32_t bytes){
+    struct stress st={ .size=size, .bytes=bytes };
+    uint8_t *buf=malloc(size);
+    pthread_t prod, cons;
+    assert(buf && RING_SIZE_OK(size));
+    ring_init(&st.ring, buf, size);
+    pthread_create(&cons, NULL, consumer, &st);
+    pthread_create(&prod, NULL, producer, &st);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    assert(ring_used(&st.ring)==0);
+    assert(ring_free(&st.ring)==size);
+    free(buf);
+    printf("ring %5u: %u bytes\n", size, bytes);
+}
+
+int main(int argc, char **argv){
+    static const uint16_t sizes[]={ 1, 2, 64, 256, 32768 };
+    uint32_t bytes=1u<<20;      //head and tail wrap 16 times
+    int opt;
+    while((opt=getopt(argc, argv, "n:"))!=-1){
+        switch(opt){
+            case 'n': bytes=strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n bytes]\n", argv[0]);
+                return 2;
+        }
+    }
+    for(unsigned i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++)
+        stress(sizes[i], bytes);
+    return 0;
+}
@@ -0,0 +1,403 @@
+/*
+ * Host tests of usbmidi.c, compiled in through usbmidi_host.h.
+ *
+ * dma_rx_drain: bytes go into a port's circular receive buffer the way
+ * the DMA writes them and are drained where the half transfer, transfer
+ * complete and idle line interrupts would, with the CNDTR they would
+ * read. What reaches USB IN must be the events of the whole stream
+ * parsed in one go, and the drain must end where the DMA is.
+ *
+ * SysEx: a 64 KB message goes from the UART to USB IN through the DMA
+ * drain and from USB OUT to the UART through the endpoint and the
+ * transmit DMA. It must come out byte for byte, one message each way in
+ * sysex_stats_in and sysex_stats_out.
+ *
+ * Coalescing: with the endpoint busy, events share a packet until
+ * USB_IN_DEADLINE_US has passed since the first, a later one starts the
+ * next packet.
+ *
+ * OUT NAK: lifting it while a received packet is still unread leaves
+ * the endpoint NAKed until the packet has been read.
+ *
+ * uart_write BLOCK: from a thread, a span of several rings goes out
+ * whole while the main thread plays the transmit DMA; from an ISR it
+ * takes what fits like NONBLOCK.
+ */
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* long enough that a loaded host does not split what comes back to back */
+#define USB_IN_DEADLINE_US 20000
+#include "usbmidi_host.h"
+
+#define RX uart2_rx_dma
+#define RX_PORT midi_uart2
+#define RX_CABLE MIDI_CABLE_UART2
+
+static uint8_t in_buf[1<<17];
+static uint32_t in_len;
+
+static void collect_in(const uint8_t *data, uint16_t len){
+    assert(in_len+len<=sizeof(in_buf));
+    memcpy(in_buf+in_len, data, len);
+    in_len+=len;
+}
+
+/* The stream written so far and the DMA write position */
+static uint8_t sent[4096];
+static uint16_t sent_len, dma_pos;
+
+static void start(uint16_t pos){
+    host_reset();
+    host_complete_in();
+    RX.tail=pos;
+    dma_pos=pos;
+    sent_len=0;
+    in_len=0;
+}
+
+static void dma_put(const uint8_t *data, uint16_t len){
+    for(uint16_t i=0;i<len;i++){
+        RX.buf[dma_pos]=data[i];
+        dma_pos=(dma_pos+1)%RX.size;
+    }
+}
+
+static void dma_write(const uint8_t *data, uint16_t len){
+    assert(sent_len+len<=sizeof(sent));
+    dma_put(data, len);
+    memcpy(sent+sent_len, data, len);
+    sent_len+=len;
+}
+
+/* The CNDTR an interrupt sees now; at the reload point it reads either */
+static uint16_t cndtr(void){
+    return RX.size-dma_pos;
+}
+
+static void drain(uint16_t remaining){
+    dma_rx_drain(&RX, remaining, &RX_PORT);
+    assert(RX.tail==dma_pos);
+    host_complete_in();
+}
+
+/* USB IN has carried exactly the events of sent */
+static void check(const char *name){
+    static uint32_t ev[sizeof(sent)];
+    struct midi_parser mp={ .cable=RX_CABLE };
+    uint16_t n;
+    assert(midi_parse(&mp, sent, sent_len, ev, sizeof(ev)/4, &n)==sent_len);
+    if(in_len!=n*4u || memcmp(in_buf, ev, in_len)){
+        fprintf(stderr, "%s: %u event bytes on USB IN, %u expected\n", name,
+                in_len, n*4u);
+        assert(0);
+    }
+    host_check();
+}
+
+/* Notes with running status, clocks between their bytes, a short SysEx */
+static uint16_t gen(uint8_t *buf, uint16_t len, uint8_t seed){
+    uint16_t n=0;
+    while(n<len){
+        switch((n+seed)%5){
+            case 0: buf[n++]=0x90; break;
+            case 1: buf[n++]=0x3c+seed%8; break;
+            case 2: buf[n++]=0xf8; break;
+            case 3: buf[n++]=0x40; break;
+            default:
+                if(len-n>=4){
+                    buf[n++]=0xf0;
+                    buf[n++]=0x7d;
+                    buf[n++]=seed&0x7f;
+                }
+                buf[n++]=0xf7;
+        }
+        seed++;
+    }
+    return len;
+}
+
+static void test_idle_line(void){
+    static const uint8_t note[]={ 0x90, 0x3c, 0x64 };
+    start(0);
+    dma_write(note, sizeof(note));
+    drain(cndtr());
+    check("idle line");
+}
+
+/* Half transfer takes the first half, a message crossing it is finished
+ * by the idle line drain */
+static void test_half_then_idle(void){
+    uint8_t buf[44];
+    gen(buf, sizeof(buf), 0);
+    start(0);
+    dma_write(buf, RX.size/2);
+    drain(cndtr());
+    dma_write(buf+RX.size/2, sizeof(buf)-RX.size/2);
+    drain(cndtr());
+    check("half transfer, idle line");
+}
+
+/* The write position has wrapped: two spans, a message across the seam */
+static void test_wrap(void){
+    uint8_t buf[12];
+    gen(buf, sizeof(buf), 3);
+    start(RX.size-5);
+    dma_write(buf, sizeof(buf));
+    assert(dma_pos<RX.tail);
+    drain(cndtr());
+    check("wrap");
+}
+
+/* Half transfer, then transfer complete with the counter before and after
+ * its reload: the second half up to the end of the buffer */
+static void test_full_buffer(void){
+    for(int reloaded=0;reloaded<2;reloaded++){
+        uint8_t buf[RX.size+7];
+        gen(buf, sizeof(buf), 1);
+        start(0);
+        dma_write(buf, RX.size/2);
+        drain(cndtr());
+        dma_write(buf+RX.size/2, RX.size/2);
+        assert(dma_pos==0);
+        drain(reloaded?RX.size:0);
+        dma_write(buf+RX.size, sizeof(buf)-RX.size);
+        drain(cndtr());
+        check(reloaded?"full buffer, CNDTR reloaded":"full buffer, CNDTR 0");
+    }
+}
+
+/* Bursts of every length up to half the buffer, drained at the idle line
+ * or at the half and full marks the way the interrupts fall */
+static void test_bursts(void){
+    uint8_t buf[sizeof(sent)];
+    gen(buf, sizeof(buf), 2);
+    start(0);
+    for(uint16_t off=0, burst=1;off<sizeof(buf);burst=burst%(RX.size/2)+1){
+        uint16_t len=sizeof(buf)-off<burst?sizeof(buf)-off:burst;
+        for(uint16_t i=0;i<len;i++){
+            dma_write(buf+off+i, 1);
+            if(dma_pos==RX.size/2 || dma_pos==0)
+                drain(dma_pos?cndtr():(off&1)*RX.size);
+        }
+        off+=len;
+        drain(cndtr());
+    }
+    check("bursts");
+}
+
+#define SYSEX_LEN 65536u
+
+static uint8_t sysex[SYSEX_LEN];
+static uint8_t uart_buf[SYSEX_LEN];
+static uint32_t uart_len;
+
+static void collect_uart(struct uart_tx *tx, const uint8_t *data, uint16_t len){
+    assert(tx==&uart2_tx);
+    assert(uart_len+len<=sizeof(uart_buf));
+    memcpy(uart_buf+uart_len, data, len);
+    uart_len+=len;
+}
+
+static void check_stats(const char *name, const struct sysex_stats *st){
+    if(st->messages!=1 || st->aborted || st->dropped || st->bytes!=SYSEX_LEN ||
+            st->last_bytes!=SYSEX_LEN){
+        fprintf(stderr, "%s: messages %u aborted %u dropped %u bytes %u last %u\n",
+                name, st->messages, st->aborted, st->dropped, st->bytes,
+                st->last_bytes);
+        assert(0);
+    }
+}
+
+/* Received a half buffer at a time, the host reading IN as it goes */
+static void test_sysex_in(void){
+    uint32_t off=0;
+    start(0);
+    memset(&sysex_stats_in, 0, sizeof(sysex_stats_in));
+    while(off<SYSEX_LEN){
+        uint16_t len=RX.size/2;
+        if(len>SYSEX_LEN-off)
+            len=SYSEX_LEN-off;
+        dma_put(sysex+off, len);
+        off+=len;
+        drain(cndtr());
+    }
+    uint32_t n=0;
+    for(uint32_t i=0;i<in_len;i+=4){
+        assert(in_buf[i]>>4==RX_CABLE);
+        uint8_t l=midi_cin_bytes(in_buf[i]&0x0f);
+        assert(n+l<=SYSEX_LEN && !memcmp(in_buf+i+1, sysex+n, l));
+        n+=l;
+    }
+    assert(n==SYSEX_LEN);
+    assert(!RX_PORT.sysex.active);
+    check_stats("sysex in", &sysex_stats_in);
+    host_check();
+}
+
+/* Sent as full USB packets, each written out before the next */
+static void test_sysex_out(void){
+    static uint32_t ev[(SYSEX_LEN+2)/3];
+    struct midi_parser mp={ .cable=RX_CABLE };
+    uint16_t n;
+    host_reset();
+    memset(&sysex_stats_out, 0, sizeof(sysex_stats_out));
+    uart_len=0;
+    host_uart_out=collect_uart;
+    //midi_parse takes 16 bit lengths: two halves
+    uint32_t used=midi_parse(&mp, sysex, SYSEX_LEN/2, ev, sizeof(ev)/4, &n);
+    uint32_t events=n;
+    assert(used==SYSEX_LEN/2);
+    used=midi_parse(&mp, sysex+used, SYSEX_LEN-used, ev+events,
+            sizeof(ev)/4-events, &n);
+    assert(used==SYSEX_LEN/2);
+    events+=n;
+    for(uint32_t i=0;i<events;i+=PKT_SIZE/4){
+        uint16_t len=events-i<PKT_SIZE/4?(events-i)*4:PKT_SIZE;
+        host_usb_out((const uint8_t *)(ev+i), len);
+        host_usb_out_thread();
+        host_complete_tx(&uart2_tx);
+    }
+    host_uart_out=NULL;
+    assert(uart_len==SYSEX_LEN && !memcmp(uart_buf, sysex, SYSEX_LEN));
+    assert(!usb_out_sysex[RX_CABLE].active);
+    check_stats("sysex out", &sysex_stats_out);
+    host_check();
+}
+
+static void test_sysex(void){
+    sysex[0]=0xf0;
+    sysex[1]=0x7d;
+    for(uint32_t i=2;i<SYSEX_LEN-1;i++)
+        sysex[i]=(i^i>>7)&0x7f;
+    sysex[SYSEX_LEN-1]=0xf7;
+    test_sysex_in();
+    test_sysex_out();
+}
+
+static uint16_t pkt_lens[16];
+static uint8_t pkts;
+
+static void count_in(const uint8_t *data, uint16_t len){
+    assert(pkts<sizeof(pkt_lens)/sizeof(pkt_lens[0]));
+    pkt_lens[pkts++]=len;
+    collect_in(data, len);
+}
+
+static void test_deadline(void){
+    static const uint8_t note[]={ 0x90, 0x3c, 0x64 };
+    start(0);
+    pkts=0;
+    host_in_packet=count_in;
+    host_uart_rx(RX_CABLE, note, 3);        //idle endpoint: out at once
+    assert(pkts==1 && usb_in_inflight==1);
+    host_uart_rx(RX_CABLE, note, 3);        //busy: these two wait together
+    host_uart_rx(RX_CABLE, note, 3);
+    assert(usb_in_fill==8 && usb_in_pending()==1);
+    usleep(USB_IN_DEADLINE_US*2);
+    host_uart_rx(RX_CABLE, note, 3);        //past the deadline: a new packet
+    assert(usb_in_fill==4 && usb_in_pending()==2);
+    host_complete_in();
+    host_in_packet=collect_in;
+    assert(pkts==3 && pkt_lens[0]==4 && pkt_lens[1]==8 && pkt_lens[2]==4);
+    host_check();
+}
+
+static void nak_lift(uint8_t why){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    usb_out_nak_clear(why);
+    CRITICAL_END();
+}
+
+static void test_nak_pending(void){
+    static const uint8_t pkt[]={ 0x09, 0x90, 0x3c, 0x64 };
+    CRITICAL_STORE;
+    host_reset();
+    CRITICAL_START();
+    usb_out_nak_set(USB_OUT_NAK_UART);
+    CRITICAL_END();
+    assert(host_out_nak);
+    nak_lift(USB_OUT_NAK_UART);             //buffer empty: lifted at once
+    assert(!host_out_nak);
+
+    CRITICAL_START();
+    usb_out_nak_set(USB_OUT_NAK_UART);
+    CRITICAL_END();
+    host_rx=pkt;                            //arrived, CTR_RX not handled yet
+    host_rx_len=sizeof(pkt);
+    host_out_pending=1;
+    nak_lift(USB_OUT_NAK_UART);
+    assert(host_out_nak && usb_out_nak==0);
+    usbmidi_data_rx_cb(usb, EP_MIDI_I);     //read, then lifted
+    assert(!host_out_pending && !host_out_nak);
+    host_usb_out_thread();
+    host_check();
+}
+
+#define BLOCK_LEN 3000u
+static volatile int block_done;
+static int block_ret;
+
+static void block_writer(uint32_t arg __unused){
+    block_ret=uart_write(2, sysex, BLOCK_LEN, UART_WRITE_BLOCK);
+    block_done=1;
+}
+
+static void test_write_block(void){
+    static ATOM_TCB tcb;
+    CRITICAL_STORE;
+    uint32_t dropped=uart2_tx.dropped;
+    _Static_assert(BLOCK_LEN>sizeof(uart2_tx_storage)*4, "several rings");
+    host_reset();
+    uart_len=0;
+    host_uart_out=collect_uart;
+    //no atom thread: ISR context, NONBLOCK
+    assert(uart_write(2, sysex, BLOCK_LEN, UART_WRITE_BLOCK)==sizeof(uart2_tx_storage));
+    assert(uart2_tx.dropped==dropped+BLOCK_LEN-sizeof(uart2_tx_storage));
+    host_complete_tx(&uart2_tx);
+    assert(uart_len==sizeof(uart2_tx_storage) && !memcmp(uart_buf, sysex, uart_len));
+
+    uart_len=0;
+    atomOSStarted=TRUE;
+    assert(atomThreadCreate(&tcb, 16, block_writer, 0, NULL, 0, FALSE)==ATOM_OK);
+    while(1){
+        CRITICAL_START();
+        if(uart2_tx.busy){
+            uint8_t *p;
+            assert(ring_peek(&uart2_tx.ring, &p)>=uart2_tx.busy);
+            collect_uart(&uart2_tx, p, uart2_tx.busy);
+            uart_tx_done(&uart2_tx);
+        }else if(block_done){
+            CRITICAL_END();
+            break;
+        }
+        CRITICAL_END();
+        sched_yield();
+    }
+    pthread_join(tcb.thread, NULL);
+    atomOSStarted=FALSE;
+    host_uart_out=NULL;
+    assert(block_ret==(int)BLOCK_LEN);
+    assert(uart_len==BLOCK_LEN && !memcmp(uart_buf, sysex, BLOCK_LEN));
+    assert(uart2_tx.dropped==dropped+BLOCK_LEN-sizeof(uart2_tx_storage));
+    host_check();
+}
+
+int main(void){
+    host_init();
+    host_in_packet=collect_in;
+    test_idle_line();
+    test_half_then_idle();
+    test_wrap();
+    test_full_buffer();
+    test_bursts();
+    test_sysex();
+    test_deadline();
+    test_nak_pending();
+    test_write_block();
+    printf("usbmidi: dma_rx_drain, %u byte SysEx both ways, deadline, OUT NAK, uart_write BLOCK ok\n",
+            SYSEX_LEN);
+    return 0;
+}
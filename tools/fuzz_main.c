@@ -0,0 +1,61 @@
+/*
+ * Stand-in for the libFuzzer driver where clang is not at hand: runs the
+ * target on the files given, or on random inputs.
+ *
+ * make fuzz FUZZCC=cc FUZZ_ENGINE=tools/fuzz_main.c
+ * ./fuzz_midi crash-file...
+ * ./fuzz_midi [-n runs] [-s seed]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_INPUT 4096
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv){
+    static uint8_t buf[MAX_INPUT];
+    unsigned long runs=10000;
+    unsigned seed=time(NULL);
+    int opt;
+    while((opt=getopt(argc, argv, "n:s:"))!=-1){
+        switch(opt){
+            case 'n': runs=strtoul(optarg, NULL, 0); break;
+            case 's': seed=strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n runs] [-s seed] [file...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if(optind<argc){
+        for(int i=optind;i<argc;i++){
+            FILE *f=fopen(argv[i], "rb");
+            if(f==NULL){
+                perror(argv[i]);
+                return 1;
+            }
+            size_t n=fread(buf, 1, sizeof(buf), f);
+            fclose(f);
+            LLVMFuzzerTestOneInput(buf, n);
+        }
+        return 0;
+    }
+
+    /* biased towards status bytes, they are where the states change */
+    fprintf(stderr, "seed %u, %lu runs\n", seed, runs);
+    srand(seed);
+    for(unsigned long r=0;r<runs;r++){
+        size_t n=rand()%sizeof(buf);
+        for(size_t i=0;i<n;i++){
+            int x=rand();
+            buf[i]=x&0x100?0x80|(x&0x7f):x&0x7f;
+        }
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * libFuzzer target for midi_parse, the UART to USB-MIDI framer.
+ *
+ * The first input byte picks the cable and how the rest is cut up: spans
+ * of varying length and room for few events, as DMA drains and a nearly
+ * full IN packet hand it over. The events must not depend on the cuts,
+ * every event must be well formed and the parser state must stay inside
+ * recv after every call. midi_parse_stamped, stamping with byte offsets,
+ * must make the same events, each stamped with its first byte.
+ */
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "midi.h"
+
+#define MAX_INPUT 4096
+
+static void check_state(const struct midi_parser *mp){
+    assert(mp->rp<sizeof(mp->recv.u8));
+    assert(mp->expected<=sizeof(mp->recv.u8));
+    assert(mp->rp==0 || mp->rp<mp->expected);
+    assert(mp->sysex<=1);
+}
+
+static void check_event(uint32_t ev, uint8_t cable){
+    uint8_t b[4];
+    memcpy(b, &ev, 4);
+    uint8_t cin=b[0]&0x0f;
+    uint8_t n=midi_cin_bytes(cin);
+    assert(b[0]>>4==cable);
+    assert(n>=1 && n<=3);               //CIN 0 and 1 are never made
+    for(uint8_t i=n+1;i<4;i++)
+        assert(b[i]==0);
+    if(cin>=0x8 && cin<=0xe){           //channel message: its status, data
+        assert(b[1]>>4==cin);
+        for(uint8_t i=2;i<=n;i++)
+            assert(b[i]<0x80);
+    }
+    if(cin==0xf)                        //single byte: realtime only
+        assert(b[1]>=0xf8);
+    if(cin==0x4)                        //sysex continues: no end in it
+        for(uint8_t i=1;i<=3;i++)
+            assert(b[i]!=0xf7 && (b[i]<0x80 || (i==1 && b[i]==0xf0)));
+}
+
+/* The byte an event is stamped with is the first one it carries */
+static void check_stamp(uint32_t ev, const uint8_t *data, size_t size, uint32_t stamp){
+    uint8_t b[4];
+    memcpy(b, &ev, 4);
+    uint8_t cin=b[0]&0x0f;
+    assert(stamp<size);
+    if(cin>=0x8 && cin<=0xe)            //running status starts at data
+        assert(data[stamp]==b[1] || (data[stamp]==b[2] && stamp>0));
+    else
+        assert(data[stamp]==b[1]);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    static uint32_t whole[MAX_INPUT], cut[MAX_INPUT], stamps[MAX_INPUT];
+    if(size<1 || size>MAX_INPUT)
+        return 0;
+    uint8_t seed=data[0];
+    uint8_t cable=seed&0x0f;
+    data++;
+    size--;
+
+    struct midi_parser mp={ .cable=cable };
+    uint16_t nwhole;
+    uint16_t used=midi_parse(&mp, data, size, whole, MAX_INPUT, &nwhole);
+    assert(used==size);
+    assert(nwhole<=size);
+    check_state(&mp);
+
+    /* again in spans of 1..16 bytes with room for 1..4 events */
+    struct midi_parser mc={ .cable=cable };
+    uint16_t ncut=0;
+    size_t off=0;
+    uint8_t span=(seed>>4)+1, room=(seed&3)+1;
+    while(off<size){
+        uint16_t len=size-off<span?size-off:span;
+        uint16_t n;
+        if(seed&0x04)
+            used=midi_parse_stamped(&mc, data+off, len, off, 1,
+                    cut+ncut, stamps+ncut, room, &n);
+        else
+            used=midi_parse(&mc, data+off, len, cut+ncut, room, &n);
+        assert(used<=len && n<=room);
+        assert(used==len || n==room);   //short only when out filled up
+        check_state(&mc);
+        off+=used;
+        ncut+=n;
+        span=span%16+1;
+        room=room%4+1;
+    }
+    assert(ncut==nwhole);
+    assert(memcmp(whole, cut, nwhole*sizeof(whole[0]))==0);
+    for(uint16_t i=0;i<nwhole;i++){
+        check_event(whole[i], cable);
+        if(seed&0x04)
+            check_stamp(whole[i], data, size, stamps[i]);
+    }
+    return 0;
+}
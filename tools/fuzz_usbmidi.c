@@ -0,0 +1,41 @@
+/*
+ * libFuzzer target for the firmware's input paths, usbmidi.c compiled in
+ * whole on the host simulator (sim/) by usbmidi_host.h.
+ *
+ * The input is a list of records, a header byte and 1..64 bytes:
+ *   0b00llllll  USB OUT packet on the MIDI endpoint, through
+ *               usbmidi_data_rx_cb and what usb_out_thread does with it
+ *   0b01llllll  CDC packet, through cdcacm_data_rx_cb
+ *   0b1pllllll  bytes received on MIDI port p, through process_midi_span
+ * l+1 bytes follow. After each record the DMA and the IN endpoint
+ * complete everything, then the pipeline invariants are checked; a wait
+ * for ring room that would never end shows up as a timeout.
+ */
+#include "usbmidi_host.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    static int initialized;
+    if(!initialized){
+        host_init();
+        initialized=1;
+    }
+    host_reset();
+    while(size>1){
+        uint8_t hdr=data[0];
+        uint16_t len=(hdr&0x3f)+1;
+        if(len>size-1)
+            len=size-1;
+        if(hdr&0x80)
+            host_uart_rx((hdr>>6)&1, data+1, len);
+        else if(hdr&0x40)
+            host_cdc(data+1, len);
+        else
+            host_usb_out(data+1, len);
+        host_usb_out_thread();
+        host_complete_in();
+        host_check();
+        data+=1+len;
+        size-=1+len;
+    }
+    return 0;
+}
@@ -0,0 +1,569 @@
+/*
+ * Host microbenchmark of the MIDI hot paths, built from the firmware's
+ * own midi.c, sysex.c and pktpool.c.
+ *
+ *   in   UART to USB: midi_parse_stamped over DMA sized spans, events
+ *        and stamps packed into pool blocks of PKT_SIZE as the IN
+ *        queue does
+ *   out  USB to UART: the usb_out_decode loop, CIN lengths, the SysEx
+ *        follower and the copy into the per port span
+ *   tx   UART transmit: the bytes written into a ring.h ring a packet's
+ *        span at a time and drained in contiguous runs, as the DMA does
+ *   len  message length of every status byte from midi_class_table
+ *
+ * Every stage is timed against a reference in the same run, what the
+ * original firmware did in its place with the same bytes (for tx the
+ * byte at a time atomQueue, for len the midilen() switch), and
+ * reported as the ratio of the two: best of ROUNDS each, the median of
+ * that over several passes. A slower or busier host slows both, so the
+ * ratio holds from run to run where ns/byte does not. make bench fails
+ * when a ratio is more than the tolerance above tools/midibench.base;
+ * make bench-baseline rewrites it. make check runs the same check after
+ * the unit tests.
+ *
+ * The in and out ratios sit above 1 for work the references skip, not
+ * for slower decoding. Taking the pieces out one at a time (x86-64,
+ * gcc -O2, median of 9 passes):
+ *   in   ~1.8-1.95 of the legacy parser. The stamps cost ~0.3-0.5 of
+ *        that and packing events into pool blocks another ~0.3-0.5;
+ *        midi_parse alone is ~1.2-1.35, the span bookkeeping and the
+ *        real time bytes inside a message that the legacy parser
+ *        mishandles.
+ *   out  ~2.3-3.0 of the CIN switch, nearly all of it the SysEx
+ *        follower; without sysex_feed the loop runs at ~0.45-0.5.
+ *
+ * midibench [-c base | -w base] [-t percent] [-n passes]
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atom.h>
+
+#include "midi.h"
+#include "sysex.h"
+#include "pktpool.h"
+#include "ring.h"
+
+#define SPAN 32                 //bytes per DMA drain
+#define MAX_BYTES 65536
+#define MAX_EVENTS (MAX_BYTES/2)
+#define ROUNDS 15
+#define ROUND_NS 2000000ull     //time each kernel is repeated for per round
+#define PASSES_MAX 31
+
+/* Single threaded, nothing to mask */
+bool cm_mask_interrupts(bool mask __unused){
+    return false;
+}
+
+struct workload {
+    const char *name;
+    uint32_t (*gen)(uint8_t *buf);
+    uint8_t buf[MAX_BYTES];
+    uint32_t len;
+    uint32_t ev[MAX_EVENTS];    //what the in stage made of it
+    uint32_t events;
+};
+
+/* B0 with running status, every controller through every value */
+static uint32_t gen_cc_sweep(uint8_t *buf){
+    uint32_t n=0;
+    buf[n++]=0xb0;
+    for(int cc=0;cc<120;cc++)
+        for(int v=0;v<128 && n+2<=32768;v++){
+            buf[n++]=cc;
+            buf[n++]=v;
+        }
+    return n;
+}
+
+/* Triads on and off, running status within each */
+static uint32_t gen_chords(uint8_t *buf){
+    uint32_t n=0;
+    for(int root=0;n+14<=32768;root=(root+5)%116){
+        buf[n++]=0x90;
+        for(int i=0;i<3;i++){
+            buf[n++]=root+(i==0?0:i==1?4:7);
+            buf[n++]=0x64;
+        }
+        buf[n++]=0x80;
+        for(int i=0;i<3;i++){
+            buf[n++]=root+(i==0?0:i==1?4:7);
+            buf[n++]=0;
+        }
+    }
+    return n;
+}
+
+/*
+ * 300 BPM is 120 clocks a second against 3125 bytes of a full 31250
+ * baud line: one 0xf8 every 26 bytes, dropped into the middle of notes.
+ */
+static uint32_t gen_clock300(uint8_t *buf){
+    uint32_t n=0, next=26;
+    uint8_t note=0;
+    while(n+4<=32768){
+        const uint8_t msg[3]={0x90, note, note?0x40:0};
+        note=(note+1)&0x7f;
+        for(int i=0;i<3;i++){
+            if(n>=next){
+                buf[n++]=0xf8;
+                next+=26;
+            }
+            buf[n++]=msg[i];
+        }
+    }
+    return n;
+}
+
+/* One 64 KB message, non-commercial ID */
+static uint32_t gen_sysex64k(uint8_t *buf){
+    uint32_t n=0;
+    buf[n++]=0xf0;
+    buf[n++]=0x7d;
+    while(n<MAX_BYTES-1){
+        buf[n]=n&0x7f;
+        n++;
+    }
+    buf[n++]=0xf7;
+    return n;
+}
+
+static struct workload workloads[]={
+    { .name="cc_sweep", .gen=gen_cc_sweep },
+    { .name="chords", .gen=gen_chords },
+    { .name="clock300", .gen=gen_clock300 },
+    { .name="sysex64k", .gen=gen_sysex64k },
+};
+#define WORKLOADS (sizeof(workloads)/sizeof(workloads[0]))
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u+ts.tv_nsec;
+}
+
+static uint32_t allocs;
+static volatile uint32_t sink;  //keeps the results alive
+
+/* Returns the events made, keeps them in ev when asked to */
+static uint32_t stage_in(struct workload *w, uint32_t *keep){
+    struct midi_parser mp={ .cable=0 };
+    struct pkt *p=NULL;
+    uint32_t total=0;
+    for(uint32_t off=0;off<w->len;){
+        uint16_t span=w->len-off<SPAN?w->len-off:SPAN;
+        uint32_t ev[SPAN], stamp[SPAN];
+        uint16_t n;
+        off+=midi_parse_stamped(&mp, w->buf+off, span, off*320, 320, ev, stamp, SPAN, &n);
+        for(uint16_t i=0;i<n;i++){
+            if(p==NULL){
+                p=pkt_alloc();
+                p->len=0;
+                allocs++;
+            }
+            memcpy(p->data+p->len, &ev[i], 4);
+            p->stamp[p->len/4]=stamp[i];
+            p->len+=4;
+            if(p->len==PKT_SIZE){
+                sink+=p->data[0];
+                pkt_free(p);
+                p=NULL;
+            }
+        }
+        if(keep)
+            memcpy(keep+total, ev, n*4);
+        total+=n;
+    }
+    if(p)
+        pkt_free(p);
+    return total;
+}
+
+static uint32_t stage_out(struct workload *w){
+    struct sysex_stream sx={0};
+    struct sysex_stats st={0};
+    uint8_t span[PKT_SIZE/4*3];
+    const uint8_t *bp=(const uint8_t *)w->ev;
+    uint32_t left=w->events*4;
+    while(left){
+        uint32_t len=left<PKT_SIZE?left:PKT_SIZE;
+        uint8_t span_len=0;
+        left-=len;
+        for(;len>=4;len-=4,bp+=4){
+            uint8_t l=midi_cin_bytes(bp[0]);
+            if(sysex_feed(&sx, &st, bp+1, l, 0)==SYSEX_IDENTITY_REQUEST)
+                sink++;
+            memcpy(span+span_len, bp+1, l);
+            span_len+=l;
+        }
+        sink+=span_len;
+    }
+    return w->events;
+}
+
+/*
+ * The references: the original firmware's byte at a time parser, as it
+ * was before the lookup table and span API, queueing into a ring, and
+ * its USB OUT loop with the CIN switch, writing into a span.
+ */
+struct legacy_uart {
+    union {
+        uint8_t u8[4];
+        uint32_t u32;
+    } recv;
+    uint8_t rp;
+    uint8_t expected;
+    uint8_t sysex;
+};
+
+static int legacy_midilen(uint8_t i){
+    switch(i&0xf0){
+        case 0x80: case 0x90: case 0xa0: case 0xb0: case 0xe0:
+            return 3;
+        case 0xc0: case 0xd0:
+            return 2;
+        case 0xf0:
+            switch(i){
+                case 0xf0: return 0xff;
+                case 0xf1: case 0xf3: return 2;
+                case 0xf2: return 3;
+                case 0xf7: return 0;
+                case 0xf6: case 0xf8: case 0xfa: case 0xfb: case 0xfc:
+                case 0xfe: case 0xff:
+                    return 1;
+            }
+    }
+    return -1;
+}
+
+static uint32_t legacy_parse(uint8_t data, struct legacy_uart *mi, uint32_t *out){
+    uint8_t done=0;
+    if(mi->rp==0 || (data&0x80)==0x80){
+        if(data==0xf0){
+            mi->recv.u8[0]=0x04;
+            mi->recv.u8[1]=data;
+            mi->expected=4;
+            mi->rp=2;
+            mi->sysex=1;
+        }else if(data==0xf7 && mi->sysex){
+            mi->recv.u8[0]=0x03+mi->rp;
+            mi->expected=mi->rp;
+            done=1;
+            mi->sysex=0;
+        }else{
+            mi->sysex=0;
+            mi->expected=legacy_midilen(data);
+            mi->recv.u8[0]=(data>>4)&0x0f;
+            mi->recv.u8[1]=data;
+            mi->rp=2;
+            if(mi->expected==1){
+                mi->recv.u8[2]=0;
+                mi->recv.u8[3]=0;
+                done=1;
+            }else if(mi->expected==2)
+                mi->recv.u8[3]=0;
+            mi->expected++;
+        }
+    }else if(mi->rp<mi->expected){
+        mi->recv.u8[mi->rp++]=data;
+        if(mi->rp>=mi->expected){
+            mi->rp=mi->sysex?1:2;
+            done=1;
+        }
+    }else{
+        mi->rp=0;
+    }
+    if(done)
+        *out=mi->recv.u32;
+    return done;
+}
+
+static uint32_t stage_ref_in(struct workload *w){
+    uint32_t ev[SPAN];
+    struct legacy_uart mi={0};
+    uint32_t n=0;
+    for(uint32_t i=0;i<w->len;i++)
+        n+=legacy_parse(w->buf[i], &mi, ev+n%SPAN);
+    sink+=ev[n%SPAN];
+    return n;
+}
+
+static uint32_t stage_ref_out(struct workload *w){
+    uint8_t span[PKT_SIZE/4*3];
+    const uint8_t *bp=(const uint8_t *)w->ev;
+    uint32_t left=w->events*4;
+    while(left){
+        uint32_t len=left<PKT_SIZE?left:PKT_SIZE;
+        uint8_t span_len=0;
+        left-=len;
+        for(;len>=4;len-=4,bp+=4){
+            uint8_t l=1;
+            if((bp[0]==0x07 || bp[0]==0x06) && bp[1]==0xf0)
+                sink++;
+            switch(bp[0]&0x0f){
+                case 0x02: case 0x0c: case 0x0d:
+                    l=2;
+                    break;
+                case 0x0f:
+                    break;
+                case 0x04: case 0x07:
+                    l++;
+                case 0x06:
+                    l++;
+                case 0x05:
+                    break;
+                default:
+                    l=3;
+            }
+            memcpy(span+span_len, bp+1, l);
+            span_len+=l;
+        }
+        sink+=span_len;
+    }
+    return w->events;
+}
+
+static uint32_t stage_tx(struct workload *w){
+    static uint8_t storage[256];
+    struct ring r=RING_INIT(storage);
+    uint32_t off=0;
+    while(1){
+        uint8_t *p;
+        uint16_t run;
+        while(off<w->len){
+            uint16_t len=w->len-off<PKT_SIZE/4*3?w->len-off:PKT_SIZE/4*3;
+            uint16_t n=ring_write(&r, w->buf+off, len);
+            off+=n;
+            if(n<len)
+                break;
+        }
+        if((run=ring_peek(&r, &p))==0)
+            break;
+        sink+=p[run-1];
+        ring_consume(&r, run);
+    }
+    return 0;
+}
+
+/*
+ * The byte queue the rings replaced: atomQueuePut/Get when nobody waits,
+ * a critical section, a unit_size copy and the index wrapped by compare.
+ */
+struct legacy_queue {
+    uint8_t *buff_ptr;
+    uint32_t unit_size, max_num_msgs;
+    uint32_t insert_index, remove_index, num_msgs_stored;
+};
+
+static uint8_t legacy_queue_put(struct legacy_queue *q, const uint8_t *msgptr){
+    CRITICAL_STORE;
+    uint8_t status=ATOM_WOULDBLOCK;
+    CRITICAL_START();
+    if(q->num_msgs_stored<q->max_num_msgs){
+        memcpy(&q->buff_ptr[q->insert_index*q->unit_size], msgptr, q->unit_size);
+        if(++q->insert_index>=q->max_num_msgs)
+            q->insert_index=0;
+        q->num_msgs_stored++;
+        status=ATOM_OK;
+    }
+    CRITICAL_END();
+    return status;
+}
+
+static uint8_t legacy_queue_get(struct legacy_queue *q, uint8_t *msgptr){
+    CRITICAL_STORE;
+    uint8_t status=ATOM_WOULDBLOCK;
+    CRITICAL_START();
+    if(q->num_msgs_stored){
+        memcpy(msgptr, &q->buff_ptr[q->remove_index*q->unit_size], q->unit_size);
+        if(++q->remove_index>=q->max_num_msgs)
+            q->remove_index=0;
+        q->num_msgs_stored--;
+        status=ATOM_OK;
+    }
+    CRITICAL_END();
+    return status;
+}
+
+static uint32_t stage_ref_tx(struct workload *w){
+    static uint8_t storage[256];
+    struct legacy_queue q={ .buff_ptr=storage, .unit_size=1, .max_num_msgs=sizeof(storage) };
+    uint8_t data;
+    for(uint32_t i=0;i<w->len;i++){
+        while(legacy_queue_put(&q, &w->buf[i])!=ATOM_OK)
+            while(legacy_queue_get(&q, &data)==ATOM_OK)  //the TXE ISR
+                sink+=data;
+    }
+    while(legacy_queue_get(&q, &data)==ATOM_OK)
+        sink+=data;
+    return 0;
+}
+
+static uint32_t stage_len(struct workload *w){
+    uint32_t n=0;
+    for(uint32_t i=0;i<w->len;i++)
+        n+=midi_len(midi_class(w->buf[i]));     //data bytes are 0
+    sink+=n;
+    return n;
+}
+
+static uint32_t stage_ref_len(struct workload *w){
+    uint32_t n=0;
+    for(uint32_t i=0;i<w->len;i++)
+        n+=legacy_midilen(w->buf[i]);   //-1 for data bytes, summed all the same
+    sink+=n;
+    return n;
+}
+
+enum stage {
+    STAGE_IN, STAGE_OUT, STAGE_TX, STAGE_LEN, STAGES,
+    STAGE_REF_IN=STAGES, STAGE_REF_OUT, STAGE_REF_TX, STAGE_REF_LEN //reference of s is s+STAGES
+};
+static const char *const stage_names[STAGES]={ "in", "out", "tx", "len" };
+
+/* ns per byte of the stage repeated for ROUND_NS */
+static double time_stage(struct workload *w, enum stage stage){
+    uint64_t t0=now_ns(), t;
+    uint32_t reps=0;
+    allocs=0;
+    do{
+        switch(stage){
+            case STAGE_IN: stage_in(w, NULL); break;
+            case STAGE_OUT: stage_out(w); break;
+            case STAGE_TX: stage_tx(w); break;
+            case STAGE_LEN: stage_len(w); break;
+            case STAGE_REF_IN: stage_ref_in(w); break;
+            case STAGE_REF_OUT: stage_ref_out(w); break;
+            case STAGE_REF_TX: stage_ref_tx(w); break;
+            case STAGE_REF_LEN: stage_ref_len(w); break;
+        }
+        reps++;
+        t=now_ns()-t0;
+    }while(t<ROUND_NS);
+    allocs/=reps;
+    return (double)t/reps/w->len;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x=*(const double *)a, y=*(const double *)b;
+    return (x>y)-(x<y);
+}
+
+static double median(double *v, int n){
+    qsort(v, n, sizeof(*v), cmp_double);
+    return v[n/2];
+}
+
+/* Best of ROUNDS of the stage, each right after one of its reference */
+static void measure(struct workload *w, enum stage stage, double *ns_per_byte, double *ratio){
+    double best=1e30, best_ref=1e30;
+    for(int round=0;round<ROUNDS;round++){
+        double ref=time_stage(w, stage+STAGES);
+        double nspb=time_stage(w, stage);
+        if(ref<best_ref)
+            best_ref=ref;
+        if(nspb<best)
+            best=nspb;
+    }
+    *ns_per_byte=best;
+    *ratio=best/best_ref;
+}
+
+/* Baseline ratio of workload and stage, 0 - not listed */
+static double base_lookup(FILE *f, const char *name, const char *stage){
+    char line[128], bname[32], bstage[8];
+    double v;
+    rewind(f);
+    while(fgets(line, sizeof(line), f)){
+        if(line[0]=='#')
+            continue;
+        if(sscanf(line, "%31s %7s %lf", bname, bstage, &v)==3 &&
+                strcmp(bname, name)==0 && strcmp(bstage, stage)==0)
+            return v;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    const char *check=NULL, *write=NULL;
+    double tolerance=25;
+    int opt, failed=0, passes=5;
+    while((opt=getopt(argc, argv, "c:w:t:n:"))!=-1){
+        switch(opt){
+            case 'c': check=optarg; break;
+            case 'w': write=optarg; break;
+            case 't': tolerance=atof(optarg); break;
+            case 'n':
+                passes=atoi(optarg);
+                if(passes<1 || passes>PASSES_MAX)
+                    passes=5;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c base | -w base] [-t percent] [-n passes]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    FILE *base=NULL;
+    if(check && (base=fopen(check, "r"))==NULL){
+        perror(check);
+        return 2;
+    }
+    if(write && (base=fopen(write, "w"))==NULL){
+        perror(write);
+        return 2;
+    }
+    if(write)
+        fprintf(base, "# workload stage time/reference, written by midibench -w\n");
+
+    pkt_pool_init();
+    for(unsigned i=0;i<WORKLOADS;i++){
+        struct workload *w=&workloads[i];
+        w->len=w->gen(w->buf);
+        w->events=stage_in(w, w->ev);
+    }
+
+    /* whole passes, so a slow spell of the host lands in one of them */
+    static double nspb[WORKLOADS*STAGES][PASSES_MAX], ratio[WORKLOADS*STAGES][PASSES_MAX];
+    uint32_t row_allocs[WORKLOADS*STAGES];
+    for(int pass=0;pass<passes;pass++)
+        for(unsigned row=0;row<WORKLOADS*STAGES;row++){
+            measure(&workloads[row/STAGES], row%STAGES,
+                    &nspb[row][pass], &ratio[row][pass]);
+            row_allocs[row]=allocs;
+        }
+
+    printf("%-10s %-5s %6s %6s %6s %8s %9s %6s\n",
+            "workload", "stage", "bytes", "events", "allocs", "ns/byte", "Mevents/s", "ratio");
+    for(unsigned row=0;row<WORKLOADS*STAGES;row++){
+        struct workload *w=&workloads[row/STAGES];
+        const char *stage=stage_names[row%STAGES];
+        double ns=median(nspb[row], passes), r=median(ratio[row], passes);
+        printf("%-10s %-5s %6u %6u %6u %8.3f %9.2f %6.3f",
+                w->name, stage, w->len, w->events, row_allocs[row],
+                ns, w->events/ns/w->len*1e3, r);
+        if(write)
+            fprintf(base, "%-10s %-5s %.4f\n", w->name, stage, r);
+        double b=check?base_lookup(base, w->name, stage):0;
+        if(b>0){
+            double pct=(r/b-1)*100;
+            printf(" %+6.1f%%", pct);
+            if(pct>tolerance){
+                printf(" REGRESSION");
+                failed=1;
+            }
+        }
+        putchar('\n');
+    }
+    if(base)
+        fclose(base);
+    if(pkt_pool_free()!=PKT_POOL_BLOCKS){
+        fprintf(stderr, "midibench: pool blocks leaked\n");
+        failed=1;
+    }
+    return failed;
+}
@@ -0,0 +1,491 @@
+/*
+ * Replay of a traffic capture (capture.h) against the host simulator.
+ *
+ * The inputs of the capture, bytes received on the UARTs and USB OUT
+ * packets, are fed to a running usbmidi-sim at their original timing or
+ * back to back (-f), UART bytes no faster than the MIDI line carries
+ * them since the sim does not model baud rates. What comes out is compared with the
+ * outputs recorded in the capture, stream by stream (USB IN by cable,
+ * packet boundaries depend on timing), and the latency from the latest
+ * input to each output is reported for both.
+ *
+ *   midireplay [-f] [-d dir] [-o out.cap] [-q ms] in.cap
+ *   midireplay -l in.cap               list the records
+ *   midireplay -a [-d dir]             arm the capture in the sim ("C1")
+ *   midireplay -g out.cap [-d dir]     fetch the capture from the sim ("CD")
+ *
+ * dir is the sim's SIM_DIR, default $SIM_DIR or ".". From a device the
+ * capture is read the same way: send "CD" to the CDC port and keep the
+ * header plus its len bytes. Exit status 1 when an output differs.
+ */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define EP_MIDI_I 0x01
+#define EP_MIDI_O 0x82
+#define EP_CDC0_R 0x04
+#define EP_CDC0_T 0x85
+
+#define PORTS 16
+#define BYTE_US 320     //one byte at 31250 baud, 10 bits
+#define CABLES 16
+/* outputs by port, USB IN split by cable: events of different cables
+ * may interleave differently from run to run, those of one cable not */
+#define STREAMS (PORTS+CABLES)
+
+struct rec {
+    uint64_t t;         //us since the start
+    uint8_t tag;
+    uint8_t len;
+    const uint8_t *data;
+};
+
+struct buf {
+    uint8_t *data;
+    size_t len, size;
+};
+
+struct latency {
+    uint64_t total, max;
+    uint32_t n;
+};
+
+static const char *dir;
+
+static void buf_add(struct buf *b, const void *data, size_t len){
+    if(b->len+len>b->size){
+        b->size=(b->len+len)*2+256;
+        if((b->data=realloc(b->data, b->size))==NULL){
+            perror("realloc");
+            exit(2);
+        }
+    }
+    memcpy(b->data+b->len, data, len);
+    b->len+=len;
+}
+
+static uint64_t now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+}
+
+static const char *path(const char *name){
+    static char p[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    snprintf(p, sizeof(p), "%s/%s", dir, name);
+    return p;
+}
+
+static const char *stream_name(uint8_t tag){
+    static char s[16];
+    if((tag&0x0f)==0)
+        snprintf(s, sizeof(s), "usb %s", tag&CAP_OUT?"in":"out");
+    else
+        snprintf(s, sizeof(s), "uart%d %s", tag&0x0f, tag&CAP_OUT?"tx":"rx");
+    return s;
+}
+
+static const char *output_name(int stream){
+    static char s[16];
+    if(stream<PORTS)
+        return stream_name(CAP_TAG(stream, 1));
+    snprintf(s, sizeof(s), "usb in %u", (stream-PORTS)&0x0f);
+    return s;
+}
+
+/* Add output bytes to their streams, returns the last stream touched */
+static int output_add(struct buf *streams, uint8_t tag, const uint8_t *data, size_t len){
+    uint8_t port=tag&0x0f;
+    if(port){
+        buf_add(&streams[port], data, len);
+        return port;
+    }
+    int stream=PORTS;
+    for(size_t i=0;i+4<=len;i+=4){
+        stream=PORTS+(data[i]>>4);
+        buf_add(&streams[stream], data+i, 4);
+    }
+    return stream;
+}
+
+/* Records of a capture file, returns how many */
+static size_t load(const char *file, struct rec **recs){
+    static struct buf raw;
+    struct cap_hdr hdr;
+    FILE *f=fopen(file, "rb");
+    if(f==NULL){
+        perror(file);
+        exit(2);
+    }
+    uint8_t chunk[4096];
+    size_t n;
+    while((n=fread(chunk, 1, sizeof(chunk), f))>0)
+        buf_add(&raw, chunk, n);
+    fclose(f);
+    if(raw.len<sizeof(hdr) || memcmp(raw.data, CAP_MAGIC, 4)!=0){
+        fprintf(stderr, "%s: not a capture\n", file);
+        exit(2);
+    }
+    memcpy(&hdr, raw.data, sizeof(hdr));
+    if(hdr.version!=CAP_VERSION || hdr.len>raw.len-sizeof(hdr)){
+        fprintf(stderr, "%s: version %u, %u of %zu bytes\n", file,
+                hdr.version, (unsigned)hdr.len, raw.len-sizeof(hdr));
+        exit(2);
+    }
+    if(hdr.flags&CAP_FLAG_FULL)
+        fprintf(stderr, "%s: capture ran out of room, the end is missing\n", file);
+
+    size_t count=0, size=0;
+    uint64_t t=0;
+    const uint8_t *p=raw.data+sizeof(hdr), *end=p+hdr.len;
+    *recs=NULL;
+    while(p+CAP_REC_HDR<=end && p+CAP_REC_HDR+p[1]<=end){
+        uint16_t dt=p[2]|p[3]<<8;
+        if(p[1]==0){
+            t+=dt*1000ull;
+        }else{
+            t+=dt;
+            if(count==size){
+                size=size*2+64;
+                *recs=realloc(*recs, size*sizeof(**recs));
+            }
+            (*recs)[count++]=(struct rec){ t, p[0], p[1], p+CAP_REC_HDR };
+        }
+        p+=CAP_REC_HDR+p[1];
+    }
+    return count;
+}
+
+/* Append a record stamped t us since the start to a capture being made */
+static void cap_add(struct buf *b, uint64_t *last, uint8_t tag, const uint8_t *data,
+        size_t len, uint64_t t){
+    uint64_t us=t-*last;
+    while(us>0xffff){
+        uint64_t ms=us/1000<0xffff?us/1000:0xffff;
+        uint8_t gap[CAP_REC_HDR]={ tag, 0, ms, ms>>8 };
+        buf_add(b, gap, sizeof(gap));
+        us-=ms*1000;
+    }
+    *last=t;
+    while(len){
+        uint8_t n=len<255?len:255;
+        uint8_t hdr[CAP_REC_HDR]={ tag, n, us, us>>8 };
+        buf_add(b, hdr, sizeof(hdr));
+        buf_add(b, data, n);
+        data+=n;
+        len-=n;
+        us=0;
+    }
+}
+
+static void cap_write(const char *file, struct buf *b){
+    struct cap_hdr hdr={ .magic=CAP_MAGIC, .version=CAP_VERSION, .len=b->len };
+    FILE *f=fopen(file, "wb");
+    if(f==NULL || fwrite(&hdr, sizeof(hdr), 1, f)!=1 ||
+            fwrite(b->data, 1, b->len, f)!=b->len || fclose(f)!=0){
+        perror(file);
+        exit(2);
+    }
+}
+
+static void list(struct rec *r, size_t n){
+    for(size_t i=0;i<n;i++){
+        printf("%10.3f %-9s %3u ", r[i].t/1000.0, stream_name(r[i].tag), r[i].len);
+        for(uint8_t j=0;j<r[i].len;j++)
+            printf(" %02x", r[i].data[j]);
+        putchar('\n');
+    }
+}
+
+static int usb_connect(void){
+    struct sockaddr_un addr={ .sun_family=AF_UNIX };
+    strncpy(addr.sun_path, path("usb.sock"), sizeof(addr.sun_path)-1);
+    int fd=socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(fd<0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))<0){
+        perror(addr.sun_path);
+        exit(2);
+    }
+    return fd;
+}
+
+/* Wait for the sim to report SET_CONFIGURATION done, see sim/usbd.c */
+static void usb_configured(int fd){
+    uint8_t msg[1+64];
+    while(1){
+        struct pollfd pfd={ .fd=fd, .events=POLLIN };
+        if(poll(&pfd, 1, 2000)<=0 || recv(fd, msg, sizeof(msg), 0)<=0){
+            fprintf(stderr, "%s: not configured\n", path("usb.sock"));
+            exit(2);
+        }
+        if(msg[0]==0x80)
+            return;
+    }
+}
+
+static void cdc_send(int fd, const char *cmd){
+    uint8_t msg[8]={ EP_CDC0_R };
+    size_t n=strlen(cmd);
+    memcpy(msg+1, cmd, n);
+    if(send(fd, msg, 1+n, 0)<0){
+        perror("send");
+        exit(2);
+    }
+}
+
+/* Fetch the sim's capture over CDC, done when header and records are in */
+static int fetch(const char *file){
+    struct buf b={0};
+    struct cap_hdr hdr;
+    uint8_t msg[1+64];
+    int fd=usb_connect();
+    cdc_send(fd, "CD");
+    while(b.len<sizeof(hdr) || b.len<sizeof(hdr)+hdr.len){
+        struct pollfd pfd={ .fd=fd, .events=POLLIN };
+        if(poll(&pfd, 1, 2000)<=0){
+            fprintf(stderr, "no capture from %s, %zu bytes\n", path("usb.sock"), b.len);
+            return 2;
+        }
+        ssize_t n=recv(fd, msg, sizeof(msg), 0);
+        if(n<=0)
+            return 2;
+        if(msg[0]==EP_CDC0_T)
+            buf_add(&b, msg+1, n-1);
+        if(b.len>=sizeof(hdr))
+            memcpy(&hdr, b.data, sizeof(hdr));
+    }
+    FILE *f=fopen(file, "wb");
+    if(f==NULL || fwrite(b.data, 1, sizeof(hdr)+hdr.len, f)!=sizeof(hdr)+hdr.len || fclose(f)){
+        perror(file);
+        return 2;
+    }
+    fprintf(stderr, "%s: %u bytes of records%s\n", file, (unsigned)hdr.len,
+            hdr.flags&CAP_FLAG_FULL?", ran out of room":"");
+    return 0;
+}
+
+static void latency_add(struct latency *l, uint64_t us){
+    l->total+=us;
+    l->n++;
+    if(us>l->max)
+        l->max=us;
+}
+
+static void latency_print(const char *what, const struct latency *l){
+    if(l->n)
+        printf("  %s latency mean %.0f us, max %llu us", what,
+                (double)l->total/l->n, (unsigned long long)l->max);
+}
+
+static int replay(struct rec *recs, size_t n, int fast, int quiet_ms, const char *out){
+    static struct buf expect[STREAMS], got[STREAMS];
+    static struct latency lat_cap[STREAMS], lat_run[STREAMS];
+    uint8_t used[STREAMS]={0};
+    uint8_t port_used[PORTS]={0};
+    struct buf session={0};
+    uint64_t session_last=0;
+    int uart[PORTS];
+    struct pollfd pfd[PORTS];
+
+    /* what the capture says came out, and how long after the last input */
+    uint64_t last_in=0;
+    for(size_t i=0;i<n;i++){
+        port_used[recs[i].tag&0x0f]=1;
+        if(recs[i].tag&CAP_OUT){
+            int stream=output_add(expect, recs[i].tag, recs[i].data, recs[i].len);
+            used[stream]=1;
+            latency_add(&lat_cap[stream], recs[i].t-last_in);
+        }else{
+            last_in=recs[i].t;
+        }
+    }
+
+    /* events that reach the device before it is configured are lost */
+    int sock=usb_connect();
+    usb_configured(sock);
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    pfd[0]=(struct pollfd){ .fd=sock, .events=POLLIN };
+    for(int port=1;port<PORTS;port++){
+        uart[port]=-1;
+        pfd[port].fd=-1;
+        if(!port_used[port])
+            continue;
+        char name[8];
+        snprintf(name, sizeof(name), "uart%d", port);
+        uart[port]=open(path(name), O_RDWR|O_NOCTTY|O_NONBLOCK);
+        if(uart[port]<0){
+            perror(path(name));
+            return 2;
+        }
+        tcflush(uart[port], TCIOFLUSH);
+        pfd[port]=(struct pollfd){ .fd=uart[port], .events=POLLIN };
+    }
+
+    size_t i=0, done=0;     //next record, bytes of it written
+    uint64_t t0=now_us(), last_activity=t0, sent_at=t0;
+    uint64_t line_free[PORTS]={0};  //-f: when the port's line is idle again
+    while(1){
+        while(i<n && recs[i].tag&CAP_OUT)
+            i++;
+        uint64_t now=now_us();
+        int timeout;
+        int in_fd=-1;
+        if(i<n){
+            uint64_t due=fast?line_free[recs[i].tag&0x0f]:t0+recs[i].t;
+            timeout=due>now?(int)((due-now+999)/1000):0;
+            if(due<=now){
+                uint8_t port=recs[i].tag&0x0f;
+                in_fd=port?uart[port]:sock;
+                timeout=-1;
+            }
+        }else{
+            uint64_t idle=(now-last_activity)/1000;
+            if(idle>=(uint64_t)quiet_ms)
+                break;
+            timeout=quiet_ms-idle;
+        }
+        for(int p=0;p<PORTS;p++)
+            pfd[p].events=POLLIN|(pfd[p].fd>=0 && pfd[p].fd==in_fd?POLLOUT:0);
+        if(poll(pfd, PORTS, timeout)<0 && errno!=EINTR){
+            perror("poll");
+            return 2;
+        }
+        now=now_us();
+
+        /* outputs */
+        uint8_t data[1+64];
+        ssize_t r;
+        while((r=recv(sock, data, sizeof(data), 0))>0){
+            if(data[0]!=EP_MIDI_O)
+                continue;
+            uint8_t tag=CAP_TAG(0, 1);
+            latency_add(&lat_run[output_add(got, tag, data+1, r-1)], now-sent_at);
+            if(out)
+                cap_add(&session, &session_last, tag, data+1, r-1, now-t0);
+            last_activity=now;
+        }
+        if(r==0){
+            fprintf(stderr, "simulator went away\n");
+            return 2;
+        }
+        for(int port=1;port<PORTS;port++){
+            if(uart[port]<0)
+                continue;
+            while((r=read(uart[port], data, sizeof(data)))>0){
+                uint8_t tag=CAP_TAG(port, 1);
+                latency_add(&lat_run[output_add(got, tag, data, r)], now-sent_at);
+                if(out)
+                    cap_add(&session, &session_last, tag, data, r, now-t0);
+                last_activity=now;
+            }
+        }
+
+        /* the input that is due */
+        if(in_fd>=0){
+            const struct rec *rec=&recs[i];
+            if(rec->tag==CAP_TAG(0, 0)){
+                data[0]=EP_MIDI_I;
+                memcpy(data+1, rec->data, rec->len);
+                r=send(sock, data, 1+rec->len, 0);
+                if(r>0)
+                    done=rec->len;
+            }else{
+                r=write(in_fd, rec->data+done, rec->len-done);
+                if(r>0)
+                    done+=r;
+            }
+            if(r<0 && errno!=EAGAIN && errno!=EINTR){
+                perror(stream_name(rec->tag));
+                return 2;
+            }
+            if(done==rec->len){
+                if(rec->tag&0x0f)
+                    line_free[rec->tag&0x0f]=now+rec->len*BYTE_US;
+                sent_at=last_activity=now;
+                if(out)
+                    cap_add(&session, &session_last, rec->tag, rec->data, rec->len, now-t0);
+                done=0;
+                i++;
+            }
+        }
+    }
+
+    int failed=0;
+    printf("replayed %zu records in %.1f ms%s\n", n,
+            (last_activity-t0)/1000.0, fast?", back to back":"");
+    for(int stream=0;stream<STREAMS;stream++){
+        if(!used[stream] && got[stream].len==0)
+            continue;
+        size_t len=expect[stream].len<got[stream].len?expect[stream].len:got[stream].len;
+        size_t diff=0;
+        while(diff<len && expect[stream].data[diff]==got[stream].data[diff])
+            diff++;
+        printf("%-9s %6zu bytes expected, %6zu got", output_name(stream),
+                expect[stream].len, got[stream].len);
+        if(diff==expect[stream].len && diff==got[stream].len){
+            printf(", same");
+        }else{
+            printf(", DIFFER at byte %zu", diff);
+            failed=1;
+        }
+        putchar('\n');
+        latency_print("capture", &lat_cap[stream]);
+        latency_print("replay", &lat_run[stream]);
+        putchar('\n');
+    }
+    if(out)
+        cap_write(out, &session);
+    return failed;
+}
+
+int main(int argc, char **argv){
+    const char *out=NULL, *fetch_file=NULL;
+    int fast=0, listing=0, arm=0, quiet_ms=300, opt;
+    dir=getenv("SIM_DIR")?getenv("SIM_DIR"):".";
+    while((opt=getopt(argc, argv, "fd:o:q:lag:"))!=-1){
+        switch(opt){
+            case 'f': fast=1; break;
+            case 'd': dir=optarg; break;
+            case 'o': out=optarg; break;
+            case 'q': quiet_ms=atoi(optarg); break;
+            case 'l': listing=1; break;
+            case 'a': arm=1; break;
+            case 'g': fetch_file=optarg; break;
+            default:
+                goto usage;
+        }
+    }
+    if(arm){
+        cdc_send(usb_connect(), "C1");
+        return 0;
+    }
+    if(fetch_file)
+        return fetch(fetch_file);
+    if(optind!=argc-1)
+        goto usage;
+
+    struct rec *recs;
+    size_t n=load(argv[optind], &recs);
+    if(listing){
+        list(recs, n);
+        return 0;
+    }
+    return replay(recs, n, fast, quiet_ms, out);
+
+usage:
+    fprintf(stderr, "usage: %s [-f] [-d dir] [-o out.cap] [-q ms] in.cap\n"
+            "       %s -l in.cap | -a | -g out.cap\n", argv[0], argv[0]);
+    return 2;
+}
@@ -0,0 +1,51 @@
+/*
+ * Decode a binary trace captured from USART1 into text.
+ *
+ * cc -I.. -o tracedump tracedump.c
+ * ./tracedump < capture.bin
+ *
+ * Frames are taken from a sliding window: when the window does not hold
+ * a marker and a record passing its CRC, one byte is dropped and the
+ * search goes on, so a capture started mid-frame or missing bytes
+ * resyncs on the next good frame.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define TRACE_NAME(name, level, desc) #name,
+static const char *names[] = {
+    TRACE_EVENTS(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+int main(void){
+    uint8_t buf[TRACE_FRAME_SIZE];
+    size_t have=0, n;
+    unsigned long skipped=0, bad=0, count=0;
+    while((n=fread(buf+have, 1, sizeof(buf)-have, stdin))>0){
+        have+=n;
+        if(have<sizeof(buf))
+            continue;
+        struct trace_rec r;
+        if(!trace_unframe(buf, &r)){
+            if(buf[0]==TRACE_SYNC && buf[1]==TRACE_SYNC2)
+                bad++;
+            skipped++;
+            memmove(buf, buf+1, --have);
+            continue;
+        }
+        have=0;
+        count++;
+        printf("%5u ", r.time);
+        if(r.id<TR_COUNT)
+            printf("%-17s", names[r.id]);
+        else
+            printf("?%-16u", r.id);
+        printf(" arg=%3u data=%08X\n", r.arg, (unsigned)r.data);
+    }
+    fprintf(stderr, "%lu records, %lu bad frames, %lu bytes out of sync\n",
+            count, bad, skipped+have);
+    return 0;
+}
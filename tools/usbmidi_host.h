@@ -0,0 +1,206 @@
+#ifndef USBMIDI_HOST_H_INCLUDED
+#define USBMIDI_HOST_H_INCLUDED
+
+/*
+ * usbmidi.c compiled in whole on the host simulator (sim/) with the USB
+ * device stubbed, for the fuzz target and the tests. Include it from one
+ * file only: it brings in usbmidi.c, with its main renamed, and the stub
+ * definitions.
+ *
+ * Nothing runs by itself. The caller feeds USB OUT packets (host_usb_out),
+ * CDC packets (host_cdc) or UART bytes (process_midi_span, dma_rx_drain)
+ * and then plays the rest of the device: host_usb_out_thread decodes the
+ * queued OUT packets, host_complete_tx runs a transmit DMA dry and
+ * host_complete_in has the host take every IN packet. host_in_packet and
+ * host_uart_out, when set, see what leaves the device.
+ */
+#include <assert.h>
+
+#define main usbmidi_main
+#include "usbmidi.c"
+#undef main
+
+struct _usbd_driver {
+    int unused;
+};
+const usbd_driver st_usbfs_v1_usb_driver;
+static int host_usbd;   //stands in for the device
+static const uint8_t *host_rx;
+static uint16_t host_rx_len;
+/* NAK state of the MIDI OUT endpoint, and a packet waiting in it unread */
+static uint8_t host_out_nak, host_out_pending;
+
+/* Every MIDI IN packet as it is handed to the endpoint */
+static void (*host_in_packet)(const uint8_t *data, uint16_t len);
+/* Every transmit DMA run, before it is released */
+static void (*host_uart_out)(struct uart_tx *tx, const uint8_t *data, uint16_t len);
+
+usbd_device *usbd_init(const usbd_driver *driver __unused,
+        const struct usb_device_descriptor *dev __unused,
+        const struct usb_config_descriptor *conf __unused,
+        const char **strings __unused, int num_strings __unused,
+        uint8_t *control_buffer __unused, uint16_t control_buffer_size __unused){
+    return (usbd_device *)&host_usbd;
+}
+
+void usbd_poll(usbd_device *dev __unused){
+}
+
+void usbd_ep_setup(usbd_device *dev __unused, uint8_t addr __unused, uint8_t type __unused,
+        uint16_t max_size __unused, usbd_endpoint_callback callback __unused){
+}
+
+/* The IN endpoints take every packet, host_complete_in finishes them */
+uint16_t usbd_ep_write_packet(usbd_device *dev __unused, uint8_t addr,
+        const void *buf, uint16_t len){
+    assert(len<=PKT_SIZE);
+    assert(addr!=EP_MIDI_O || len%4==0);
+    if(addr==EP_MIDI_O && host_in_packet)
+        host_in_packet(buf, len);
+    return len;
+}
+
+uint16_t usbd_ep_read_packet(usbd_device *dev __unused, uint8_t addr __unused,
+        void *buf, uint16_t len){
+    if(len>host_rx_len)
+        len=host_rx_len;
+    if(buf)
+        memcpy(buf, host_rx, len);
+    host_out_pending=0;
+    return len;
+}
+
+void usbd_ep_nak_set(usbd_device *dev __unused, uint8_t addr, uint8_t nak){
+    if(addr==EP_MIDI_I)
+        host_out_nak=nak;
+}
+
+int usb_ep_out_pending(uint8_t ep){
+    return ep==EP_MIDI_I && host_out_pending;
+}
+
+int usbd_register_control_callback(usbd_device *dev __unused, uint8_t type __unused,
+        uint8_t type_mask __unused, usbd_control_callback callback __unused){
+    return 0;
+}
+
+int usbd_register_set_config_callback(usbd_device *dev __unused,
+        usbd_set_config_callback callback __unused){
+    return 0;
+}
+
+static uint8_t route_default[sizeof(usb_out_route)];
+
+static __unused void host_init(void){
+    pkt_pool_init();
+    assert(atomQueueCreate(&usb_out_queue, (uint8_t *)usb_out_queue_storage,
+                sizeof(struct pkt *),
+                sizeof(usb_out_queue_storage)/sizeof(struct pkt *))==ATOM_OK);
+    assert(atomSemCreate(&usb_in_sem, 0)==ATOM_OK);
+#define HOST_ROOM_SEM(cable, n, tx_size, rx_size, rx_dma) \
+    assert(atomSemCreate(&uart##n##_tx.room, 0)==ATOM_OK);
+    MIDI_PORTS(HOST_ROOM_SEM)
+    assert(atomSemCreate(&uart1_tx.room, 0)==ATOM_OK);
+    usb=usbd_init(&st_usbfs_v1_usb_driver, NULL, NULL, NULL, 0, NULL, 0);
+    usb_set_config(usb, 1);
+    memcpy(route_default, usb_out_route, sizeof(route_default));
+}
+
+/* Back to a device just configured */
+static __unused void host_reset(void){
+    memcpy(usb_out_route, route_default, sizeof(usb_out_route));
+    capture_stop();
+    cdc_dumping=0;
+    memset(usb_out_sysex, 0, sizeof(usb_out_sysex));
+#define HOST_PORT_RESET(c, n, tx_size, rx_size, rx_dma) \
+    memset(&midi_uart##n.parser, 0, sizeof(midi_uart##n.parser)); \
+    midi_uart##n.parser.cable=(c); \
+    memset(&midi_uart##n.sysex, 0, sizeof(midi_uart##n.sysex));
+    MIDI_PORTS(HOST_PORT_RESET)
+}
+
+/* A packet on the MIDI OUT endpoint, through the endpoint ISR */
+static __unused void host_usb_out(const uint8_t *data, uint16_t len){
+    assert(!host_out_nak && !host_out_pending);   //NAKed or full, the host retries
+    host_rx=data;
+    host_rx_len=len;
+    host_out_pending=1;
+    usbmidi_data_rx_cb(usb, EP_MIDI_I);
+    assert(!host_out_pending);
+}
+
+static __unused void host_cdc(const uint8_t *data, uint16_t len){
+    host_rx=data;
+    host_rx_len=len;
+    cdcacm_data_rx_cb(usb, EP_CDC0_R);
+}
+
+/* What usb_out_thread does for each queued packet, without blocking */
+static __unused void host_usb_out_thread(void){
+    CRITICAL_STORE;
+    struct pkt *p;
+    while(atomQueueGet(&usb_out_queue, -1, (uint8_t *)&p)==ATOM_OK){
+        assert(p->len<=PKT_SIZE);
+        usb_out_decode(p->data, p->len);
+        pkt_free(p);
+        CRITICAL_START();
+        usb_out_pool_check();
+        CRITICAL_END();
+    }
+}
+
+/* The transmit DMA runs the ring dry */
+static __unused void host_complete_tx(struct uart_tx *tx){
+    assert(ring_used(&tx->ring)<=tx->ring.mask+1);
+    while(tx->busy){
+        uint8_t *p;
+        assert(ring_peek(&tx->ring, &p)>=tx->busy);
+        if(host_uart_out)
+            host_uart_out(tx, p, tx->busy);
+        uart_tx_done(tx);
+    }
+    assert(ring_used(&tx->ring)==0);
+    assert(tx->want==0 && tx->waiters==0 && tx->want_nak==0);
+}
+
+/* The host reads every IN packet, including a partly filled one */
+static __unused void host_complete_in(void){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    usb_in_flush();
+    CRITICAL_END();
+    while(usb_in_inflight)
+        usbmidi_data_tx_cb(usb, EP_MIDI_O);
+    assert(usb_in_pending()==0);
+    assert(usb_in_fill==0 && usb_in_resv==0);
+}
+
+/* Everything sent, nothing held: the pipeline invariants */
+static __unused void host_check(void){
+    for(uint8_t port=0;port<MIDI_PORT_COUNT;port++)
+        assert(usb_out_span_len[port]==0);
+    for(uint8_t c=0;c<MIDI_PORT_COUNT;c++)
+        assert(usb_out_sysex[c].hlen<=SYSEX_HEAD);
+#define HOST_PORT_CHECK(cable, n, tx_size, rx_size, rx_dma) \
+    assert(midi_uart##n.parser.rp<4 && midi_uart##n.parser.expected<=4); \
+    assert(midi_uart##n.sysex.hlen<=SYSEX_HEAD); \
+    host_complete_tx(&uart##n##_tx);
+    MIDI_PORTS(HOST_PORT_CHECK)
+    host_complete_tx(&uart1_tx);
+    assert(usb_out_nak==0 && host_out_nak==0);
+    /* usb_in_cur may keep an empty block for the next event */
+    assert(pkt_pool_free()==PKT_POOL_BLOCKS-(usb_in_cur!=NULL));
+}
+
+/* Bytes received on the port of the cable, as one span */
+static __unused void host_uart_rx(uint8_t cable, const uint8_t *data, uint16_t len){
+    switch(cable){
+#define HOST_PORT_RX(c, n, tx_size, rx_size, rx_dma) \
+        case c: \
+            process_midi_span(data, len, tstamp_now(), &midi_uart##n); \
+            break;
+        MIDI_PORTS(HOST_PORT_RX)
+    }
+}
+
+#endif
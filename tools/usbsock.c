@@ -0,0 +1,101 @@
+/*
+ * Host end of the simulator's USB socket.
+ *
+ * cc -o usbsock usbsock.c
+ * ./usbsock [-t] [usb.sock]
+ *
+ * Every stdin line is one OUT packet in hex, endpoint first:
+ *   01 09 90 3c 7f     note on, cable 0, to EP 0x01
+ * IN packets are printed the same way, with -t prefixed by the
+ * milliseconds since start.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000ul+ts.tv_nsec/1000000;
+}
+
+/* Returns the packet length, 0 - nothing usable on the line */
+static int parse(char *line, unsigned char *pkt, int size){
+    int n=0;
+    for(char *tok=strtok(line, " \t\r\n");tok && n<size;tok=strtok(NULL, " \t\r\n")){
+        char *end;
+        unsigned long v=strtoul(tok, &end, 16);
+        if(*end || v>0xff){
+            fprintf(stderr, "usbsock: bad byte '%s'\n", tok);
+            return 0;
+        }
+        pkt[n++]=v;
+    }
+    return n>1?n:0;
+}
+
+int main(int argc, char **argv){
+    struct sockaddr_un addr={ .sun_family=AF_UNIX };
+    int stamp=0, opt;
+    while((opt=getopt(argc, argv, "t"))!=-1){
+        if(opt!='t'){
+            fprintf(stderr, "usage: %s [-t] [usb.sock]\n", argv[0]);
+            return 2;
+        }
+        stamp=1;
+    }
+    strncpy(addr.sun_path, optind<argc?argv[optind]:"usb.sock", sizeof(addr.sun_path)-1);
+
+    int fd=socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(fd<0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))<0){
+        perror(addr.sun_path);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    unsigned long t0=ms();
+    struct pollfd pfd[2]={ {.fd=0, .events=POLLIN}, {.fd=fd, .events=POLLIN} };
+    char line[512];
+    size_t fill=0;
+    unsigned char pkt[65];
+    while(1){
+        if(poll(pfd, 2, -1)<0)
+            return 1;
+        if(pfd[0].revents){
+            /* stdin done: keep printing until the device goes away */
+            ssize_t n=read(0, line+fill, sizeof(line)-1-fill);
+            if(n<=0)
+                pfd[0].fd=-1;
+            else
+                fill+=n;
+            char *nl;
+            while((nl=memchr(line, '\n', fill)) || fill==sizeof(line)-1){
+                size_t len=nl?(size_t)(nl-line)+1:fill;
+                line[len-1]=0;
+                int plen=parse(line, pkt, sizeof(pkt));
+                if(plen && send(fd, pkt, plen, 0)<0){
+                    perror("send");
+                    return 1;
+                }
+                memmove(line, line+len, fill-len);
+                fill-=len;
+            }
+        }
+        if(pfd[1].revents){
+            ssize_t n=recv(fd, pkt, sizeof(pkt), 0);
+            if(n<=0)
+                return 0;
+            if(stamp)
+                printf("%6lu ", ms()-t0);
+            for(ssize_t i=0;i<n;i++)
+                printf(i?" %02x":"%02x", pkt[i]);
+            putchar('\n');
+        }
+    }
+}
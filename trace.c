@@ -0,0 +1,67 @@
+#include <atom.h>
+#include <atomsem.h>
+#include <atomtimer.h>
+
+#include "trace.h"
+
+static struct trace_rec trace_ring[TRACE_DEPTH];
+static uint16_t trace_head;
+static uint16_t trace_tail;
+uint32_t trace_lost;
+static ATOM_SEM trace_sem;
+static uint8_t trace_waiting;   //trace_wait sleeps on trace_sem
+
+uint8_t trace_init(void){
+    return atomSemCreate(&trace_sem, 0);
+}
+
+/* Callable from any context, overwrites the oldest record when full */
+void trace_put(uint8_t id, uint8_t arg, uint32_t data){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    struct trace_rec *r=&trace_ring[trace_head%TRACE_DEPTH];
+    r->time=(uint16_t)atomTimeGet();
+    r->id=id;
+    r->arg=arg;
+    r->data=data;
+    trace_head++;
+    if((uint16_t)(trace_head-trace_tail)>TRACE_DEPTH){
+        trace_tail++;
+        trace_lost++;
+    }
+    if(trace_waiting){
+        trace_waiting=0;
+        atomSemPut(&trace_sem);
+    }
+    CRITICAL_END();
+}
+
+int trace_get(struct trace_rec *rec){
+    CRITICAL_STORE;
+    int ok=0;
+    CRITICAL_START();
+    if(trace_tail!=trace_head){
+        *rec=trace_ring[trace_tail%TRACE_DEPTH];
+        trace_tail++;
+        ok=1;
+    }
+    CRITICAL_END();
+    return ok;
+}
+
+/* Thread context: sleep until a record is there and take it */
+void trace_wait(struct trace_rec *rec){
+    CRITICAL_STORE;
+    while(1){
+        CRITICAL_START();
+        if(trace_tail!=trace_head){
+            *rec=trace_ring[trace_tail%TRACE_DEPTH];
+            trace_tail++;
+            CRITICAL_END();
+            return;
+        }
+        trace_waiting=1;
+        CRITICAL_END();
+        atomSemGet(&trace_sem, 0);
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Binary trace of hot path events.
+ *
+ * Records are fixed size and go into a RAM ring; a low priority thread
+ * sleeps in trace_wait until there are some and sends them out of USART1
+ * as frames (see trace_frame), tools/tracedump.c turns such a dump back
+ * into text. When the ring is full the oldest record is overwritten and
+ * counted in trace_lost.
+ *
+ * TRACE_LEVEL selects what is compiled in, calls above it vanish:
+ * 0 - nothing, 1 - drops and errors, 2 - + USB packets, 3 - + every event
+ */
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 1
+#endif
+
+#ifndef TRACE_DEPTH
+#define TRACE_DEPTH 64
+#endif
+
+#define TRACE_SYNC  0xA5
+#define TRACE_SYNC2 0x5A
+
+/* X(name, level, description of arg/data) */
+#define TRACE_EVENTS(X) \
+    X(TR_NONE,          0, "") \
+    X(TR_UART_DROP,     1, "arg=port data=bytes") \
+    X(TR_MIDI_DROP,     1, "arg=port data=event") \
+    X(TR_USB_IN_BUSY,   1, "arg=len") \
+    X(TR_USB_IN_DROP,   1, "arg=len data=overflow count") \
+    X(TR_USB_OUT_LOST,  1, "data=lost count") \
+    X(TR_USB_OUT_PKT,   2, "arg=len") \
+    X(TR_USB_IN_PKT,    2, "arg=len") \
+    X(TR_USB_IN_DONE,   2, "") \
+    X(TR_SYSEX_ID,      2, "") \
+    X(TR_USB_OUT_EVENT, 3, "data=event") \
+    X(TR_MIDI_EVENT,    3, "arg=port data=event") \
+    X(TR_USB_OUT_NAK,   2, "arg=reason data=1 set/0 lifted")
+
+#define TRACE_ENUM(name, level, desc) name,
+enum trace_id {
+    TRACE_EVENTS(TRACE_ENUM)
+    TR_COUNT
+};
+#undef TRACE_ENUM
+
+struct trace_rec {
+    uint16_t time;   //low bits of the system tick
+    uint8_t id;
+    uint8_t arg;
+    uint32_t data;
+} __attribute__((packed));
+
+/*
+ * On the wire a record is TRACE_SYNC TRACE_SYNC2 <record> <crc>. The CRC-8
+ * (poly 0x07) covers the record, so a reader that lost bytes or started
+ * mid-frame drops frames that fail it and looks for the marker again.
+ */
+#define TRACE_FRAME_SIZE (2+sizeof(struct trace_rec)+1)
+
+static inline uint8_t trace_crc(const uint8_t *p, unsigned len){
+    uint8_t crc=0;
+    while(len--){
+        crc^=*p++;
+        for(int i=0; i<8; i++)
+            crc=(uint8_t)(crc&0x80 ? (crc<<1)^0x07 : crc<<1);
+    }
+    return crc;
+}
+
+static inline void trace_frame(uint8_t *frame, const struct trace_rec *rec){
+    frame[0]=TRACE_SYNC;
+    frame[1]=TRACE_SYNC2;
+    __builtin_memcpy(frame+2, rec, sizeof(*rec));
+    frame[2+sizeof(*rec)]=trace_crc(frame+2, sizeof(*rec));
+}
+
+/* 1 if frame holds a marker and a record that passes its check */
+static inline int trace_unframe(const uint8_t *frame, struct trace_rec *rec){
+    if(frame[0]!=TRACE_SYNC || frame[1]!=TRACE_SYNC2
+            || frame[2+sizeof(*rec)]!=trace_crc(frame+2, sizeof(*rec)))
+        return 0;
+    __builtin_memcpy(rec, frame+2, sizeof(*rec));
+    return 1;
+}
+
+uint8_t trace_init(void);
+void trace_put(uint8_t id, uint8_t arg, uint32_t data);
+int trace_get(struct trace_rec *rec);
+void trace_wait(struct trace_rec *rec);
+extern uint32_t trace_lost;
+
+#if TRACE_LEVEL >= 1
+#define TRACE_ERR(id, arg, data) trace_put((id), (arg), (data))
+#else
+#define TRACE_ERR(id, arg, data) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 2
+#define TRACE_PKT(id, arg, data) trace_put((id), (arg), (data))
+#else
+#define TRACE_PKT(id, arg, data) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 3
+#define TRACE_EVT(id, arg, data) trace_put((id), (arg), (data))
+#else
+#define TRACE_EVT(id, arg, data) ((void)0)
+#endif
+
+#endif
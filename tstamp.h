@@ -0,0 +1,31 @@
+#ifndef TSTAMP_H_INCLUDED
+#define TSTAMP_H_INCLUDED
+
+#include <stdint.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/rcc.h>
+
+#include "midi.h"
+
+/*
+ * Event timestamps: the DWT cycle counter, free running at the core
+ * clock once main has enabled it, 1/48 us at 48 MHz. Only differences
+ * mean anything; they come out right across the counter wrap (89 s) as
+ * long as they are shorter than that.
+ */
+typedef uint32_t tstamp_t;
+
+static inline tstamp_t tstamp_now(void){
+    return dwt_read_cycle_counter();
+}
+
+static inline uint32_t tstamp_us(tstamp_t from, tstamp_t to){
+    return (to-from)/(rcc_ahb_frequency/1000000);
+}
+
+/* Time one byte takes on a MIDI port */
+static inline uint32_t tstamp_midi_byte(void){
+    return rcc_ahb_frequency/(MIDI_BAUD/MIDI_BYTE_BITS);
+}
+
+#endif
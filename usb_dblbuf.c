@@ -0,0 +1,141 @@
+#include <libopencm3/stm32/memorymap.h>
+#include <libopencm3/cm3/common.h>
+
+#include "usb_dblbuf.h"
+
+/* Endpoint register bits, RM0008 23.5.2 */
+#define EPR(ep)         MMIO32(USB_DEV_FS_BASE + ((ep)&0x0f)*4)
+#define EPR_CTR_RX      0x8000
+#define EPR_DTOG_RX     0x4000
+#define EPR_STAT_RX     0x3000
+#define EPR_KIND        0x0100
+#define EPR_CTR_TX      0x0080
+#define EPR_DTOG_TX     0x0040
+#define EPR_STAT_TX     0x0030
+#define EPR_STAT_TX_VALID 0x0030
+/* read/write bits, everything else is toggle or clear-on-0 */
+#define EPR_RW          0x070F
+
+/* SW_BUF is the other direction's DTOG bit */
+#define EPR_SW_BUF_OUT  EPR_DTOG_TX
+#define EPR_SW_BUF_IN   EPR_DTOG_RX
+
+/* Buffer descriptor table, 16 bit words at 32 bit stride on F1 */
+#define BTABLE          MMIO32(USB_DEV_FS_BASE + 0x50)
+#define BDT(ep, off)    MMIO32(USB_PMA_BASE + (BTABLE + ((ep)&0x0f)*8 + (off))*2)
+#define BDT_ADDR0(ep)   BDT(ep, 0)
+#define BDT_COUNT0(ep)  BDT(ep, 2)
+#define BDT_ADDR1(ep)   BDT(ep, 4)
+#define BDT_COUNT1(ep)  BDT(ep, 6)
+#define BDT_COUNT_MASK  0x03ff
+
+/* Toggle the given toggle bits, leave the rest of the register alone */
+static void epr_toggle(uint8_t ep, uint32_t bits){
+    EPR(ep)=(EPR(ep)&EPR_RW) | EPR_CTR_RX | EPR_CTR_TX | bits;
+}
+
+static void epr_set_kind(uint8_t ep){
+    EPR(ep)=(EPR(ep)&EPR_RW) | EPR_KIND | EPR_CTR_RX | EPR_CTR_TX;
+}
+
+static void epr_clear_ctr_rx(uint8_t ep){
+    EPR(ep)=(EPR(ep)&EPR_RW) | EPR_CTR_TX;
+}
+
+static void pma_write(uint16_t addr, const uint8_t *src, uint16_t len){
+    volatile uint32_t *pma=&MMIO32(USB_PMA_BASE + addr*2);
+    uint16_t i;
+    for(i=0;i+1<len;i+=2)
+        *pma++=src[i] | (src[i+1]<<8);
+    if(len&1)
+        *pma=src[i];
+}
+
+static void pma_read(uint16_t addr, uint8_t *dst, uint16_t len){
+    volatile uint32_t *pma=&MMIO32(USB_PMA_BASE + addr*2);
+    uint16_t i;
+    for(i=0;i+1<len;i+=2){
+        uint16_t w=*pma++;
+        dst[i]=w;
+        dst[i+1]=w>>8;
+    }
+    if(len&1)
+        dst[i]=*pma;
+}
+
+/*
+ * libopencm3 left the single buffer in ADDR_RX (buffer 1 in DBL_BUF
+ * terms) with DTOG_RX=0 and STAT_RX=VALID. Buffer 0 goes to pma_addr;
+ * SW_BUF=1 lets the peripheral fill buffer 0 first.
+ */
+void usb_dblbuf_setup_out(uint8_t ep, uint16_t pma_addr){
+    BDT_ADDR0(ep)=pma_addr;
+    BDT_COUNT0(ep)=BDT_COUNT1(ep); //same block size encoding
+    epr_set_kind(ep);
+    if((EPR(ep)&EPR_SW_BUF_OUT)==0)
+        epr_toggle(ep, EPR_SW_BUF_OUT);
+}
+
+/*
+ * libopencm3 left the single buffer in ADDR_TX (buffer 0) with DTOG_TX=0
+ * and STAT_TX=NAK. Buffer 1 goes to pma_addr. With DTOG_TX==SW_BUF the
+ * peripheral NAKs until the first packet is written, so STAT_TX can be
+ * VALID from the start.
+ */
+void usb_dblbuf_setup_in(uint8_t ep, uint16_t pma_addr){
+    BDT_ADDR1(ep)=pma_addr;
+    BDT_COUNT1(ep)=0;
+    epr_set_kind(ep);
+    uint32_t r=EPR(ep);
+    uint32_t bits=(r^EPR_STAT_TX_VALID)&EPR_STAT_TX;
+    if(r&EPR_SW_BUF_IN)
+        bits|=EPR_SW_BUF_IN;
+    epr_toggle(ep, bits);
+}
+
+/*
+ * Called on CTR_RX. Handing the other buffer back to the peripheral
+ * first lets the next packet arrive while this one is copied out.
+ */
+uint16_t usb_dblbuf_read(uint8_t ep, void *buf, uint16_t len){
+    epr_clear_ctr_rx(ep);
+    epr_toggle(ep, EPR_SW_BUF_OUT);
+    uint16_t addr, count;
+    if(EPR(ep)&EPR_SW_BUF_OUT){
+        addr=BDT_ADDR1(ep);
+        count=BDT_COUNT1(ep)&BDT_COUNT_MASK;
+    }else{
+        addr=BDT_ADDR0(ep);
+        count=BDT_COUNT0(ep)&BDT_COUNT_MASK;
+    }
+    if(count>len)
+        count=len;
+    pma_read(addr, buf, count);
+    return count;
+}
+
+/*
+ * IN: with SW_BUF==DTOG_TX the peripheral NAKs and both buffers are the
+ * firmware's; toggling SW_BUF hands over the buffer it pointed at. A
+ * second toggle before CTR_TX would make them equal again and the first
+ * packet would never go out, so only one packet is handed over at a
+ * time. The next one may be copied into the other buffer meanwhile.
+ */
+void usb_dblbuf_fill(uint8_t ep, const void *buf, uint16_t len){
+    if(EPR(ep)&EPR_SW_BUF_IN){
+        pma_write(BDT_ADDR1(ep), buf, len);
+        BDT_COUNT1(ep)=len;
+    }else{
+        pma_write(BDT_ADDR0(ep), buf, len);
+        BDT_COUNT0(ep)=len;
+    }
+}
+
+/* Only with nothing in flight: after setup or CTR_TX */
+void usb_dblbuf_send(uint8_t ep){
+    epr_toggle(ep, EPR_SW_BUF_IN);
+}
+
+int usb_ep_out_pending(uint8_t ep){
+    return (EPR(ep)&EPR_CTR_RX)!=0;
+}
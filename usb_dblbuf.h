@@ -0,0 +1,28 @@
+#ifndef USB_DBLBUF_H_INCLUDED
+#define USB_DBLBUF_H_INCLUDED
+
+#include <stdint.h>
+
+/*
+ * Double buffered bulk endpoints on the STM32 USB FS peripheral.
+ *
+ * libopencm3 sets the endpoint up single buffered; these switch it to
+ * DBL_BUF and add the second packet memory buffer. From then on the
+ * endpoint must only be accessed through these, not
+ * usbd_ep_read_packet/usbd_ep_write_packet.
+ *
+ * OUT: the peripheral fills one buffer while the other is being read.
+ * IN: one packet is with the peripheral at a time; the next one is copied
+ * in (usb_dblbuf_fill) while it goes out and handed over (usb_dblbuf_send)
+ * on its TX complete, which then costs a register write instead of a copy.
+ */
+void usb_dblbuf_setup_out(uint8_t ep, uint16_t pma_addr);
+void usb_dblbuf_setup_in(uint8_t ep, uint16_t pma_addr);
+uint16_t usb_dblbuf_read(uint8_t ep, void *buf, uint16_t len);
+void usb_dblbuf_fill(uint8_t ep, const void *buf, uint16_t len);
+void usb_dblbuf_send(uint8_t ep);
+
+/* Either mode: an OUT packet has arrived and its CTR_RX is not yet handled */
+int usb_ep_out_pending(uint8_t ep);
+
+#endif
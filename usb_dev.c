@@ -1,4 +1,5 @@
 #include "usb_dev.h"
+#include "ports.h"
 
 static const struct usb_device_descriptor dev = {
     .bLength = USB_DT_DEVICE_SIZE,
@@ -7,7 +8,7 @@ static const struct usb_device_descriptor dev = {
     .bDeviceClass = 0,   /* device defined at interface level */
     .bDeviceSubClass = 0,
     .bDeviceProtocol = 0,
-    .bMaxPacketSize0 = 64,
+    .bMaxPacketSize0 = EP0_SIZE,
     .idVendor = 0x3137,  /* Prototype product vendor ID */
     .idProduct = 0xC0DE, /* dd if=/dev/random bs=2 count=1 | hexdump */
     .bcdDevice = 0x0100,
@@ -18,39 +19,49 @@ static const struct usb_device_descriptor dev = {
 };
 
 /*
- * Midi specific endpoint descriptors.
+ * Jack IDs of a port: embedded IN and external OUT carry the host to
+ * device direction, external IN and embedded OUT the other one.
  */
-struct usb_midi_endpoint_descriptor2 {
+#define JACK_IN_EMBEDDED(cable)  ((cable)*4+1)
+#define JACK_OUT_EXTERNAL(cable) ((cable)*4+2)
+#define JACK_IN_EXTERNAL(cable)  ((cable)*4+3)
+#define JACK_OUT_EMBEDDED(cable) ((cable)*4+4)
+
+/*
+ * Midi specific endpoint descriptors, one embedded jack per cable.
+ */
+struct usb_midi_endpoint_descriptor_ports {
 	struct usb_midi_endpoint_descriptor_head head;
-	struct usb_midi_endpoint_descriptor_body jack[2];
+	struct usb_midi_endpoint_descriptor_body jack[MIDI_PORT_COUNT];
 } __attribute__((packed));
 
+#define ENDP_OUT_JACK(cable, uart, tx_size, rx_size, rx_dma) [cable] = { .baAssocJackID = JACK_IN_EMBEDDED(cable) },
+#define ENDP_IN_JACK(cable, uart, tx_size, rx_size, rx_dma) [cable] = { .baAssocJackID = JACK_OUT_EMBEDDED(cable) },
 
-static const struct usb_midi_endpoint_descriptor midi_bulk_endp_out = {
+static const struct usb_midi_endpoint_descriptor_ports midi_bulk_endp_out = {
     /* Table B-12: MIDI Adapter Class-specific Bulk OUT Endpoint
      * Descriptor
      */
     .head = {
-        .bLength = sizeof(struct usb_midi_endpoint_descriptor),
+        .bLength = sizeof(struct usb_midi_endpoint_descriptor_ports),
         .bDescriptorType = USB_AUDIO_DT_CS_ENDPOINT,
         .bDescriptorSubType = USB_MIDI_SUBTYPE_MS_GENERAL,
-        .bNumEmbMIDIJack = 1,
+        .bNumEmbMIDIJack = MIDI_PORT_COUNT,
     },
-        .jack[0] = { .baAssocJackID = 0x01 }, 
+    .jack = { MIDI_PORTS(ENDP_OUT_JACK) },
 };
 
-static const struct usb_midi_endpoint_descriptor midi_bulk_endp_in = {
+static const struct usb_midi_endpoint_descriptor_ports midi_bulk_endp_in = {
     /* Table B-14: MIDI Adapter Class-specific Bulk IN Endpoint
      * Descriptor
      */
     .head = {
-        .bLength = sizeof(struct usb_midi_endpoint_descriptor),
+        .bLength = sizeof(struct usb_midi_endpoint_descriptor_ports),
         .bDescriptorType = USB_AUDIO_DT_CS_ENDPOINT,
         .bDescriptorSubType = USB_MIDI_SUBTYPE_MS_GENERAL,
-        .bNumEmbMIDIJack = 1,
+        .bNumEmbMIDIJack = MIDI_PORT_COUNT,
     },
-        .jack[0] = { .baAssocJackID = 0x04 }, 
-//        .jack[1] = { .baAssocJackID = 0x06 }, 
+    .jack = { MIDI_PORTS(ENDP_IN_JACK) },
 };
 
 /*
@@ -124,20 +135,76 @@ static const struct usb_interface_descriptor audio_control_iface[] = {{
 } };
 
 /*
- * Class-specific MIDI streaming interface descriptor
+ * Class-specific MIDI streaming interface descriptor, four jacks per port
  */
-const struct {
-    struct usb_midi_header_descriptor header;
+struct midi_port_jacks {
+    struct usb_midi_in_jack_descriptor in_embedded;
+    struct usb_midi_out_jack_descriptor out_external;
 
-    struct usb_midi_in_jack_descriptor in_embedded1;
-    struct usb_midi_out_jack_descriptor out_external1;
-
-    struct usb_midi_in_jack_descriptor in_external1;
-    struct usb_midi_out_jack_descriptor out_embedded1;
+    struct usb_midi_in_jack_descriptor in_external;
+    struct usb_midi_out_jack_descriptor out_embedded;
+} __attribute__((packed));
 
-    struct usb_midi_in_jack_descriptor in_external2;
-    struct usb_midi_out_jack_descriptor out_embedded2;
+#define PORT_JACKS(cable, uart, tx_size, rx_size, rx_dma) [cable] = { \
+    /* Table B-7: MIDI Adapter MIDI IN Jack Descriptor (Embedded) */ \
+    .in_embedded = { \
+        .bLength = sizeof(struct usb_midi_in_jack_descriptor), \
+        .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE, \
+        .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_IN_JACK, \
+        .bJackType = USB_MIDI_JACK_TYPE_EMBEDDED, \
+        .bJackID = JACK_IN_EMBEDDED(cable), \
+        .iJack = 0x00, \
+    }, \
+    /* Table B-10: MIDI Adapter MIDI OUT Jack Descriptor (External) */ \
+    .out_external = { \
+        .head = { \
+            .bLength = sizeof(struct usb_midi_out_jack_descriptor), \
+            .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE, \
+            .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_OUT_JACK, \
+            .bJackType = USB_MIDI_JACK_TYPE_EXTERNAL, \
+            .bJackID = JACK_OUT_EXTERNAL(cable), \
+            .bNrInputPins = 1, \
+        }, \
+        .source[0] = { \
+            .baSourceID = JACK_IN_EMBEDDED(cable), \
+            .baSourcePin = 0x01, \
+        }, \
+        .tail = { \
+            .iJack = 0x00, \
+        }, \
+    }, \
+    /* Table B-8: MIDI Adapter MIDI IN Jack Descriptor (External) */ \
+    .in_external = { \
+        .bLength = sizeof(struct usb_midi_in_jack_descriptor), \
+        .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE, \
+        .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_IN_JACK, \
+        .bJackType = USB_MIDI_JACK_TYPE_EXTERNAL, \
+        .bJackID = JACK_IN_EXTERNAL(cable), \
+        .iJack = 0x00, \
+    }, \
+    /* Table B-9: MIDI Adapter MIDI OUT Jack Descriptor (Embedded) */ \
+    .out_embedded = { \
+        .head = { \
+            .bLength = sizeof(struct usb_midi_out_jack_descriptor), \
+            .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE, \
+            .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_OUT_JACK, \
+            .bJackType = USB_MIDI_JACK_TYPE_EMBEDDED, \
+            .bJackID = JACK_OUT_EMBEDDED(cable), \
+            .bNrInputPins = 1, \
+        }, \
+        .source[0] = { \
+            .baSourceID = JACK_IN_EXTERNAL(cable), \
+            .baSourcePin = 0x01, \
+        }, \
+        .tail = { \
+            .iJack = 0x00, \
+        }, \
+    }, \
+},
 
+const struct {
+    struct usb_midi_header_descriptor header;
+    struct midi_port_jacks port[MIDI_PORT_COUNT];
 } __attribute__((packed)) midi_streaming_functional_descriptors = {
     /* Table B-6: Midi Adapter Class-specific MS Interface Descriptor */
     .header = {
@@ -147,88 +214,7 @@ const struct {
         .bcdMSC = 0x0100,
         .wTotalLength = sizeof(midi_streaming_functional_descriptors),
     },
-    /* Table B-7: MIDI Adapter MIDI IN Jack Descriptor (Embedded) */
-    .in_embedded1 = {
-        .bLength = sizeof(struct usb_midi_in_jack_descriptor),
-        .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE,
-        .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_IN_JACK, //2
-        .bJackType = USB_MIDI_JACK_TYPE_EMBEDDED, //1
-        .bJackID = 0x01,
-        .iJack = 0x00,
-    },
-    /* Table B-10: MIDI Adapter MIDI OUT Jack Descriptor (External) */
-    .out_external1 = {
-        .head = {
-            .bLength = sizeof(struct usb_midi_out_jack_descriptor),
-            .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE,
-            .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_OUT_JACK, //3
-            .bJackType = USB_MIDI_JACK_TYPE_EXTERNAL, //2
-            .bJackID = 0x02,
-            .bNrInputPins = 1,
-        },
-        .source[0] = {
-            .baSourceID = 0x01,
-            .baSourcePin = 0x01,
-        },
-        .tail = {
-            .iJack = 0x00,
-        },
-    },
-    /* Table B-8: MIDI Adapter MIDI IN Jack Descriptor (External) */
-    .in_external1 = {
-        .bLength = sizeof(struct usb_midi_in_jack_descriptor),
-        .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE,
-        .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_IN_JACK, //2
-        .bJackType = USB_MIDI_JACK_TYPE_EXTERNAL, //2
-        .bJackID = 0x03,
-        .iJack = 0x00,
-    },
-    /* Table B-9: MIDI Adapter MIDI OUT Jack Descriptor (Embedded) */
-    .out_embedded1 = {
-        .head = {
-            .bLength = sizeof(struct usb_midi_out_jack_descriptor),
-            .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE,
-            .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_OUT_JACK, //3
-            .bJackType = USB_MIDI_JACK_TYPE_EMBEDDED,  //1
-            .bJackID = 0x04,
-            .bNrInputPins = 1,
-        },
-        .source[0] = {
-            .baSourceID = 0x03,
-            .baSourcePin = 0x01,
-        },
-        .tail = {
-            .iJack = 0x00,
-        }
-    },
-
-    /* Table B-8: MIDI Adapter MIDI IN Jack Descriptor (External) */
-    .in_external2 = {
-        .bLength = sizeof(struct usb_midi_in_jack_descriptor),
-        .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE,
-        .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_IN_JACK, //2
-        .bJackType = USB_MIDI_JACK_TYPE_EXTERNAL, //2
-        .bJackID = 0x05,
-        .iJack = 0x00,
-    },
-    /* Table B-9: MIDI Adapter MIDI OUT Jack Descriptor (Embedded) */
-    .out_embedded2 = {
-        .head = {
-            .bLength = sizeof(struct usb_midi_out_jack_descriptor),
-            .bDescriptorType = USB_AUDIO_DT_CS_INTERFACE,
-            .bDescriptorSubtype = USB_MIDI_SUBTYPE_MIDI_OUT_JACK, //3
-            .bJackType = USB_MIDI_JACK_TYPE_EMBEDDED,  //1
-            .bJackID = 0x06,
-            .bNrInputPins = 1,
-        },
-        .source[0] = {
-            .baSourceID = 0x05,
-            .baSourcePin = 0x01,
-        },
-        .tail = {
-            .iJack = 0x00,
-        }
-    },
+    .port = { MIDI_PORTS(PORT_JACKS) },
 };
 
 /*
@@ -299,14 +285,14 @@ static const struct usb_endpoint_descriptor data0_endp[] = {{
         .bDescriptorType = USB_DT_ENDPOINT,
         .bEndpointAddress = EP_CDC0_R,
         .bmAttributes = USB_ENDPOINT_ATTR_BULK,
-        .wMaxPacketSize = 64,
+        .wMaxPacketSize = CDC_PKT_SIZE,
         .bInterval = 1,
 }, {
     .bLength = USB_DT_ENDPOINT_SIZE,
         .bDescriptorType = USB_DT_ENDPOINT,
         .bEndpointAddress = EP_CDC0_T,
         .bmAttributes = USB_ENDPOINT_ATTR_BULK,
-        .wMaxPacketSize = 64,
+        .wMaxPacketSize = CDC_PKT_SIZE,
         .bInterval = 1,
 }};
 
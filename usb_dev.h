@@ -19,6 +19,26 @@
 #define IF_COMM0 2
 #define IF_CDAT0 3
 
+/*
+ * MIDI bulk endpoints double buffered (usb_dblbuf.c). Packet memory is
+ * only 512 bytes, so EP0 and the CDC data endpoints go down to 32 bytes
+ * to make room for the second MIDI buffers at the top of it. Off until
+ * it has been tried on hardware and measured against single buffering.
+ */
+#ifndef USB_MIDI_DBLBUF
+#define USB_MIDI_DBLBUF 0
+#endif
+
+#if USB_MIDI_DBLBUF
+#define EP0_SIZE 32
+#define CDC_PKT_SIZE 32
+#define PMA_MIDI_I_BUF0 0x180
+#define PMA_MIDI_O_BUF1 0x1C0
+#else
+#define EP0_SIZE 64
+#define CDC_PKT_SIZE 64
+#endif
+
 usbd_device * init_usb(void);
 
 
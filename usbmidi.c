@@ -5,7 +5,9 @@
 #include <libopencm3/stm32/desig.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
-#include <libopencm3/cm3/systick.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/dwt.h>
+#include <libopencm3/stm32/exti.h>
 
 #include <atom.h>
 #include <atomsem.h>
@@ -15,10 +17,28 @@
 
 #include "hw.h"
 #include "usb_dev.h"
+#include "usb_dblbuf.h"
+#include "ring.h"
+#include "trace.h"
+#include "pktpool.h"
+#include "midi.h"
+#include "ports.h"
+#include "sysex.h"
+#include "idle.h"
+#include "capture.h"
+#include "tstamp.h"
 
 static uint8_t idle_stack[256];
-static uint8_t master_thread_stack[512];
+static uint8_t sleep_thread_stack[256];
+static ATOM_TCB sleep_thread_tcb;
+static uint8_t master_thread_stack[256];
 static ATOM_TCB master_thread_tcb;
+static uint8_t usb_out_thread_stack[256];
+static ATOM_TCB usb_out_thread_tcb;
+#if TRACE_LEVEL > 0
+static uint8_t trace_thread_stack[256];
+static ATOM_TCB trace_thread_tcb;
+#endif
 
 #warning ok
 
@@ -32,34 +52,173 @@ static ATOM_QUEUE uart0_rx;
 static uint8_t uart0_rx_storage[64];
 */
 
-static ATOM_QUEUE uart3_tx;
-static uint8_t uart3_tx_storage[64];
-
 /*
-static ATOM_QUEUE uart3_rx;
-static uint8_t uart3_rx_storage[16];
-*/
+ * UART transmit path. DMA sends the contiguous span at the ring's tail
+ * and consumes it on transfer complete. Threads short of room sleep on
+ * the port's room semaphore: usb_out_thread on the MIDI ports,
+ * trace_thread on port 1, and any of them may share a port. Once the
+ * smallest want is met every waiter is woken and checks again.
+ */
+struct uart_tx {
+    struct ring ring;
+    volatile uint16_t busy; //bytes in flight, 0 - DMA idle
+    volatile uint16_t want; //least room a waiter needs, 0 - none
+    uint8_t waiters;        //threads asleep on room
+    uint8_t want_nak;       //USB_OUT_NAK_* reasons held while they wait
+    uint8_t channel;
+    uint32_t dropped;       //bytes uart_write could not take
+    ATOM_SEM room;          //posted once per waiter when want is met
+};
+static struct uart_tx *uart_tx_port(int file);
 
-static ATOM_QUEUE uart2_tx;
-static uint8_t uart2_tx_storage[288];
+static uint8_t uart1_tx_storage[256];
+static struct uart_tx uart1_tx={
+    .ring=RING_INIT(uart1_tx_storage),
+    .channel=DMA_CH(UART1_TX_DMA)
+};
+_Static_assert(RING_SIZE_OK(sizeof(uart1_tx_storage)), "ring size");
+
+static struct ring uart1_rx;
+static uint8_t uart1_rx_storage[64];
+_Static_assert(RING_SIZE_OK(sizeof(uart1_rx_storage)), "ring size");
 
 /*
-static ATOM_QUEUE uart2_rx;
-static uint8_t uart2_rx_storage[16];
-*/
+ * USB OUT packets go from the endpoint ISR to usb_out_thread in pool
+ * blocks. The endpoint is NAKed while the pool is down to the packets it
+ * may still deliver plus the blocks kept for USB IN, and while the thread
+ * waits for room in a UART ring; the host then retries at the rate the
+ * UART drains.
+ */
+static ATOM_QUEUE usb_out_queue;
+static struct pkt *usb_out_queue_storage[PKT_POOL_BLOCKS];
+#if USB_MIDI_DBLBUF
+#define USB_OUT_HW_PENDING 1 //the other buffer may be filling already
+#else
+#define USB_OUT_HW_PENDING 0
+#endif
+#define USB_OUT_IN_RESERVE 2 //an OUT flood must not starve the UART parsers
+#define USB_OUT_NAK_POOL 1
+#define USB_OUT_NAK_UART 2
+static volatile uint8_t usb_out_nak; //USB_OUT_NAK_* reasons in effect
+static uint8_t usb_out_nak_late;    //cleared with a packet unread, lift after the read
+static void usb_out_pool_check(void);
+static uint32_t usb_out_lost;
 
-static ATOM_QUEUE uart1_tx;
-static uint8_t uart1_tx_storage[1024];
+/*
+ * USB OUT routing: cable number to a mask of UART ports, bit n-1 for
+ * port n. Changed at runtime with the CDC command "R<cable><mask>", the
+ * cable a hex digit, the mask one or two; usb_out_decode takes a copy
+ * once per packet. Only MIDI ports may be routed to, port 1 is the
+ * console.
+ */
+#define ROUTE_PORT(n) (1<<((n)-1))
+#define ROUTE_DEFAULT(cable, uart, tx_size, rx_size, rx_dma) [cable]=ROUTE_PORT(uart),
+static uint8_t usb_out_route[16]={
+    MIDI_PORTS(ROUTE_DEFAULT)
+};
+#define ROUTE_MIDI_PORT(cable, uart, tx_size, rx_size, rx_dma) |ROUTE_PORT(uart)
+#define ROUTE_MIDI_PORTS (0 MIDI_PORTS(ROUTE_MIDI_PORT))
+#define ROUTE_CHECK(cable, uart, tx_size, rx_size, rx_dma) \
+    _Static_assert((uart)>=2 && (uart)<=8, "uart" #uart " outside the route mask");
+MIDI_PORTS(ROUTE_CHECK)
+
+/* UART of each MIDI port, by MIDI_PORT_INDEX_UART<n> */
+#define PORT_UART(cable, uart, tx_size, rx_size, rx_dma) [MIDI_PORT_INDEX_UART##uart]=(uart),
+static const uint8_t midi_port_uart[MIDI_PORT_COUNT]={
+    MIDI_PORTS(PORT_UART)
+};
 
-static ATOM_QUEUE uart1_rx;
-static uint8_t uart1_rx_storage[64];
+/*
+ * USB IN coalescing. Parsers write their events straight into the packet
+ * being assembled (usb_in_cur). It goes out at once when the endpoint is
+ * idle; while it is busy events gather in the packet until it is full,
+ * the previous packet completes or USB_IN_DEADLINE_US passes since the
+ * first of them arrived.
+ * The deadline is kept on DWT timestamps and checked wherever the packet
+ * could change: before events are added to it and on TX complete, when
+ * a held packet can next leave. So no event joins a packet past its
+ * deadline. master_thread's timed wait, whole system ticks, is only the
+ * backstop for a line that has gone quiet.
+ * A parser fills the slots it has reserved with interrupts enabled;
+ * until it commits, usb_in_cur is not sent and nobody else gets room.
+ */
+#ifndef USB_IN_DEADLINE_US
+#define USB_IN_DEADLINE_US 1000
+#endif
+
+static struct pkt *usb_in_cur;
+static uint8_t usb_in_fill;         //bytes of usb_in_cur taken
+static uint8_t usb_in_resv;         //a producer is filling usb_in_cur beyond fill
+static tstamp_t usb_in_first;       //when the first event was committed
+static ATOM_SEM usb_in_sem;         //an empty packet got its first event
+static uint32_t usb_in_sem_cycle;   //DWT cycle count usb_in_sem was posted at
+
+struct usb_in_stats {
+    uint32_t packets;
+    uint32_t events;
+    uint32_t fill[16];      //packets by number of events carried, [n-1]
+    uint32_t wait_total_us; //first event arrival to hand-off
+    uint32_t wait_max_us;
+    uint32_t delivered;     //events the host has taken, their latency
+    uint32_t latency_total_us;  //from the first byte on the UART to TX complete
+    uint32_t latency_min_us;
+    uint32_t latency_max_us;
+    uint32_t wakes;         //master_thread woken by usb_in_sem
+    uint32_t wake_total_cycles; //usb_in_sem posted to master_thread running
+    uint32_t wake_max_cycles;
+};
+static struct usb_in_stats usb_in_stats;
+
+/*
+ * USB IN transmit queue of complete packets. Submitting never blocks:
+ * the packet goes to the endpoint right away when it is idle, otherwise
+ * TX complete sends the next one. When all slots are taken the new packet
+ * is dropped and counted in usb_in_overflow.
+ * The queue owns submitted pool blocks and frees them on TX complete.
+ */
+#ifndef USB_IN_QUEUE
+#define USB_IN_QUEUE 4
+#endif
+_Static_assert((USB_IN_QUEUE&(USB_IN_QUEUE-1))==0, "USB_IN_QUEUE power of two");
+/* leave the OUT path at least two blocks, see USB_OUT_HW_PENDING */
+_Static_assert(USB_IN_QUEUE+1+2 <= PKT_POOL_BLOCKS, "pool too small for USB_IN_QUEUE");
+
+static struct pkt *usb_in_queue[USB_IN_QUEUE];
+static volatile uint8_t usb_in_head;
+static volatile uint8_t usb_in_tail; //oldest packet not yet completed
+static volatile uint8_t usb_in_inflight; //packets handed to the endpoint
+static uint32_t usb_in_overflow;
 
-static ATOM_QUEUE midi_input;
-static uint32_t midi_input_storage[64];
+/*
+ * The endpoint takes one packet at a time in either mode. Double buffered,
+ * the packet after it is copied into the other buffer early (usb_in_staged)
+ * and handed over on TX complete.
+ */
+#define USB_IN_HW_SLOTS 1
+#if USB_MIDI_DBLBUF
+static uint8_t usb_in_staged;
+/* libopencm3 allocates packet memory upwards from 0x40 in usbd_ep_setup order */
+_Static_assert(0x40 + 2*EP0_SIZE + 64 + 64 + 2*CDC_PKT_SIZE + 16 <= PMA_MIDI_I_BUF0,
+        "packet memory overlaps the second MIDI buffers");
+#endif
 
 void _fault(int, int, const char*);
+/*
+ * How uart_write treats a span that does not fit into the ring:
+ * NONBLOCK - take what fits, ALL - take all of it or nothing,
+ * BLOCK - wait for the DMA to make room, half a ring at a time, so spans
+ * longer than the ring go through too (thread context only, falls back
+ * to NONBLOCK from an ISR). Another producer's bytes may land between
+ * the chunks of a BLOCK write; a caller that needs the span in one piece
+ * waits with uart_wait_room and writes with ALL.
+ */
+enum uart_write_mode {
+    UART_WRITE_NONBLOCK,
+    UART_WRITE_ALL,
+    UART_WRITE_BLOCK
+};
+int uart_write(int file, const uint8_t *ptr, int len, enum uart_write_mode mode);
 int u_write(int file, uint8_t *ptr, int len);
-inline int s_write(int file, char *ptr, int len);
 
 #define fault(code) _fault(code,__LINE__,__FUNCTION__)
 void _fault(__unused int code, __unused int line, __unused const char* function){
@@ -75,205 +234,575 @@ usbd_device *usb;
  * Definition for MIDI Devices, release 1.0.
  */
 
-/* SysEx identity message, preformatted with correct USB framing information */
-const uint8_t sysex_identity[] = {
-    0x04,	/* USB Framing (3 byte SysEx) */
+/* SysEx identity reply, framed for USB by midi_parse on the way out */
+static const uint8_t sysex_identity[] = {
     0xf0,	/* SysEx start */
     0x7e,	/* non-realtime */
     0x00,	/* Channel 0 */
-
-    0x04,	/* USB Framing (3 byte SysEx) */
+    0x06,	/* General information */
+    0x02,	/* Identity reply */
     0x7d,	/* Educational/prototype manufacturer ID */
     0x66,	/* Family code (byte 1) */
     0x66,	/* Family code (byte 2) */
-
-    0x04,	/* USB Framing (3 byte SysEx) */
     0x51,	/* Model number (byte 1) */
     0x19,	/* Model number (byte 2) */
     0x00,	/* Version number (byte 1) */
-
-    0x04,	/* USB Framing (3 byte SysEx) */
     0x00,	/* Version number (byte 2) */
     0x01,	/* Version number (byte 3) */
     0x00,	/* Version number (byte 4) */
-
-    0x05,	/* USB Framing (1 byte SysEx) */
     0xf7,	/* SysEx end */
-    0,0,	/* Padding */
 };
 
+/* SysEx traffic: in - UART to USB, out - USB to UART */
+static struct sysex_stats sysex_stats_in;
+static struct sysex_stats sysex_stats_out;
+static struct sysex_stream usb_out_sysex[MIDI_PORT_COUNT];
+
 struct midi_uart {
-    union {
-        uint8_t u8[4];
-        uint32_t u32;
-    } recv;
+    struct midi_parser parser;
+    struct sysex_stream sysex;
     uint8_t uart_id;
-    uint8_t rp;
-    uint8_t expected;
-    uint8_t sysex;
 };
-void process_midi_uart(uint8_t data, struct midi_uart *mi);
+void process_midi_span(const uint8_t *data, uint16_t len, tstamp_t last,
+        struct midi_uart *mi);
+
+/*
+ * Circular DMA receive buffer. DMA owns the write position (size - CNDTR),
+ * tail is the first byte not yet handed to the parser.
+ */
+struct dma_rx {
+    uint8_t *buf;
+    uint16_t size;
+    uint16_t tail;
+};
+void dma_rx_drain(struct dma_rx *rx, uint16_t remaining, struct midi_uart *mi);
+
+/*
+ * Per port state generated from MIDI_PORTS: uart<n>_tx transmit ring,
+ * uart<n>_rx_dma receive buffer of a DMA port and midi_uart<n> parser.
+ */
+#define MIDI_PORT_RX_STATE_1(n, rx_size) \
+    static uint8_t uart##n##_rx_dma_storage[rx_size]; \
+    static struct dma_rx uart##n##_rx_dma={ \
+        .buf=uart##n##_rx_dma_storage, \
+        .size=rx_size, \
+        .tail=0 \
+    };
+#define MIDI_PORT_RX_STATE_0(n, rx_size)
+
+#define MIDI_PORT_STATE(c, n, tx_size, rx_size, rx_dma) \
+    static uint8_t uart##n##_tx_storage[tx_size]; \
+    static struct uart_tx uart##n##_tx={ \
+        .ring=RING_INIT(uart##n##_tx_storage), \
+        .channel=DMA_CH(UART##n##_TX_DMA) \
+    }; \
+    _Static_assert(RING_SIZE_OK(tx_size), "uart" #n " ring size"); \
+    _Static_assert((tx_size)>=PKT_SIZE/4*3, "uart" #n " ring below a USB packet"); \
+    MIDI_PORT_RX_STATE_##rx_dma(n, rx_size) \
+    static struct midi_uart midi_uart##n={ \
+        .parser.cable=(c), \
+        .uart_id=n, \
+    };
+
+MIDI_PORTS(MIDI_PORT_STATE)
+
+/*
+ * Static RAM of the large buffers against the 10K of stm32-h103.ld,
+ * leaving 1K for the rest (libopencm3, USB control buffer, small vars).
+ */
+#define RAM_SIZE (10*1024)
+#define MIDI_PORT_RAM(cable, n, tx_size, rx_size, rx_dma) \
+    +(tx_size)+((rx_dma)?(rx_size)+sizeof(struct dma_rx):0)+ \
+    sizeof(struct uart_tx)+sizeof(struct midi_uart)
+#if TRACE_LEVEL > 0
+#define TRACE_RAM (sizeof(trace_thread_stack)+TRACE_DEPTH*sizeof(struct trace_rec))
+#else
+#define TRACE_RAM 0
+#endif
+_Static_assert(0 MIDI_PORTS(MIDI_PORT_RAM)
+        +sizeof(uart1_tx_storage)+sizeof(uart1_rx_storage)
+        +PKT_POOL_BLOCKS*sizeof(struct pkt)
+        +sizeof(idle_stack)+sizeof(sleep_thread_stack)
+        +sizeof(master_thread_stack)
+        +sizeof(usb_out_thread_stack)+TRACE_RAM+CAPTURE_SIZE
+        <= RAM_SIZE-1024, "buffers do not fit in RAM");
+
+/* Hand queued packets to the endpoint while it has room; USB IRQ must be excluded */
+static void usb_in_start(void){
+    uint8_t queued=(uint8_t)(usb_in_head-usb_in_tail);
+#if USB_MIDI_DBLBUF
+    if(usb_in_inflight==0 && queued){
+        struct pkt *p=usb_in_queue[usb_in_tail%USB_IN_QUEUE];
+        if(!usb_in_staged)
+            usb_dblbuf_fill(EP_MIDI_O, p->data, p->len);
+        usb_dblbuf_send(EP_MIDI_O);
+        usb_in_staged=0;
+        usb_in_inflight=1;
+    }
+    if(usb_in_inflight && !usb_in_staged && queued>1){
+        struct pkt *p=usb_in_queue[(uint8_t)(usb_in_tail+1)%USB_IN_QUEUE];
+        usb_dblbuf_fill(EP_MIDI_O, p->data, p->len);
+        usb_in_staged=1;
+    }
+#else
+    while(usb_in_inflight<USB_IN_HW_SLOTS && queued>usb_in_inflight){
+        struct pkt *p=
+            usb_in_queue[(uint8_t)(usb_in_tail+usb_in_inflight)%USB_IN_QUEUE];
+        if(usbd_ep_write_packet(usb, EP_MIDI_O, p->data, p->len) == 0)
+            return;
+        usb_in_inflight++;
+    }
+#endif
+}
+
+static uint8_t usb_in_pending(void){
+    return (uint8_t)(usb_in_head-usb_in_tail);
+}
+
+/* Takes ownership of p on success, the caller keeps it otherwise */
+static int usb_in_submit_pkt(struct pkt *p){
+    CRITICAL_STORE;
+    int ok=0;
+    CRITICAL_START();
+    if(usb_in_pending()<USB_IN_QUEUE){
+        CAPTURE(CAP_TAG(0, 1), p->data, p->len);
+        usb_in_queue[usb_in_head%USB_IN_QUEUE]=p;
+        usb_in_head++;
+        usb_in_start();
+        ok=1;
+    }
+    CRITICAL_END();
+    return ok;
+}
+
+/* The packet being assembled has events older than USB_IN_DEADLINE_US */
+static int usb_in_late(void){
+    return usb_in_fill && tstamp_us(usb_in_first, tstamp_now())>=USB_IN_DEADLINE_US;
+}
+
+/*
+ * Hand the packet being assembled to the transmit queue. Stays put when
+ * the queue is full or slots are reserved, TX complete or the commit
+ * tries again. Interrupts must be masked.
+ */
+static void usb_in_flush(void){
+    if(usb_in_fill==0 || usb_in_resv)
+        return;
+    usb_in_cur->len=usb_in_fill;
+    if(!usb_in_submit_pkt(usb_in_cur)){
+        TRACE_ERR(TR_USB_IN_BUSY, usb_in_fill, 0);
+        return;
+    }
+    TRACE_PKT(TR_USB_IN_PKT, usb_in_fill, 0);
+
+    uint8_t events=usb_in_fill/4;
+    uint32_t wait_us=tstamp_us(usb_in_cur->stamp[0], tstamp_now());
+    usb_in_stats.packets++;
+    usb_in_stats.events+=events;
+    usb_in_stats.fill[(events-1)&0x0f]++;
+    usb_in_stats.wait_total_us+=wait_us;
+    if(wait_us>usb_in_stats.wait_max_us)
+        usb_in_stats.wait_max_us=wait_us;
+    usb_in_cur=NULL;
+    usb_in_fill=0;
+}
 
-void xcout(unsigned char c);
+/*
+ * Reserve the free event slots of the packet being assembled, *slot
+ * points to the first and *stamp to its timestamp. Returns how many there
+ * are, 0 when no packet can be had or another producer holds them; MIDI
+ * port interrupts share a priority, so one never cuts into another.
+ * Interrupts masked; every reservation ends with usb_in_commit.
+ */
+static uint8_t usb_in_reserve(uint32_t **slot, uint32_t **stamp){
+    if(usb_in_resv)
+        return 0;
+    if(usb_in_fill==PKT_SIZE || usb_in_late())
+        usb_in_flush();
+    if(usb_in_cur==NULL && (usb_in_cur=pkt_alloc())==NULL)
+        return 0;
+    usb_in_resv=1;
+    *slot=(uint32_t*)(usb_in_cur->data+usb_in_fill);
+    *stamp=usb_in_cur->stamp+usb_in_fill/4;
+    return (PKT_SIZE-usb_in_fill)/4;
+}
+
+/* Take the first events of the reserved slots, give back the rest */
+static void usb_in_commit(uint8_t events){
+    usb_in_resv=0;
+    if(events==0)
+        return;
+    if(usb_in_fill==0){
+        usb_in_first=tstamp_now();
+        usb_in_sem_cycle=dwt_read_cycle_counter();
+        atomSemPut(&usb_in_sem);
+    }
+    usb_in_fill+=events*4;
+    if(usb_in_fill==PKT_SIZE)
+        usb_in_flush();
+}
+
+/* Deadline of the packet being assembled as system ticks to wait, at least 1 */
+static uint32_t usb_in_deadline_ticks(void){
+    uint32_t waited=tstamp_us(usb_in_first, tstamp_now());
+    uint32_t left=waited<USB_IN_DEADLINE_US?USB_IN_DEADLINE_US-waited:0;
+    return (left*(uint64_t)SYSTEM_TICKS_PER_SEC+999999)/1000000+(left==0);
+}
+
+/*
+ * Send what has been assembled if the endpoint has a free buffer or the
+ * deadline has passed. Returns ticks left to the deadline, 0 if none.
+ */
+static uint32_t usb_in_poke(void){
+    if(usb_in_fill==0)
+        return 0;
+    if(usb_in_pending()<USB_IN_HW_SLOTS || usb_in_late()){
+        usb_in_flush();
+        if(usb_in_fill==0)
+            return 0;
+    }
+    return usb_in_deadline_ticks();
+}
+
+/*
+ * Copy a prebuilt packet into a pool block and queue it, drop when full.
+ * Its events are stamped now.
+ */
+static int usb_in_submit(const void *buf, uint8_t len){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    usb_in_flush(); //keep event order
+    CRITICAL_END();
+    struct pkt *p=pkt_alloc();
+    if(p){
+        tstamp_t now=tstamp_now();
+        memcpy(p->data, buf, len);
+        p->len=len;
+        for(uint8_t i=0;i<len/4;i++)
+            p->stamp[i]=now;
+        if(usb_in_submit_pkt(p))
+            return 1;
+        pkt_free(p);
+    }
+    usb_in_overflow++;
+    TRACE_ERR(TR_USB_IN_DROP, len, usb_in_overflow);
+    return 0;
+}
 
-void xcout(unsigned char c){
-    static char set[]="0123456789ABCDEF";
-    char s[2];
-    s[0]=set[(c>>4)&0x0f];
-    s[1]=set[c&0x0f];
-    s_write(1,s,2);
+/* Drop everything queued, the endpoint was just set up again */
+static void usb_in_reset(void){
+    while(usb_in_tail!=usb_in_head){
+        pkt_free(usb_in_queue[usb_in_tail%USB_IN_QUEUE]);
+        usb_in_tail++;
+    }
+    usb_in_inflight=0;
+#if USB_MIDI_DBLBUF
+    usb_in_staged=0;
+#endif
+    usb_out_pool_check();
 }
 
+/* Arrival to delivery of the events of a packet the host has taken */
+static void usb_in_latency(const struct pkt *p){
+    tstamp_t now=tstamp_now();
+    for(uint8_t i=0;i<p->len/4;i++){
+        uint32_t us=tstamp_us(p->stamp[i], now);
+        if(usb_in_stats.delivered==0 || us<usb_in_stats.latency_min_us)
+            usb_in_stats.latency_min_us=us;
+        if(us>usb_in_stats.latency_max_us)
+            usb_in_stats.latency_max_us=us;
+        usb_in_stats.latency_total_us+=us;
+        usb_in_stats.delivered++;
+    }
+}
 
 static void usbmidi_data_tx_cb(usbd_device *usbd_dev __maybe_unused, uint8_t ep __maybe_unused) {
-    s_write(1,"%",1);
+    CRITICAL_STORE;
+    TRACE_PKT(TR_USB_IN_DONE, 0, 0);
+    CRITICAL_START();
+    if(usb_in_inflight){
+        struct pkt *p=usb_in_queue[usb_in_tail%USB_IN_QUEUE];
+        usb_in_inflight--;
+        usb_in_latency(p);
+        pkt_free(p);
+        usb_in_tail++;
+        usb_out_pool_check();
+    }
+    usb_in_start();
+    usb_in_poke();
+    CRITICAL_END();
     gpio_toggle(GPIOB, GPIO8);
 }
 
+static int usb_midi_read(usbd_device *usbd_dev __maybe_unused, void *buf, uint16_t len){
+#if USB_MIDI_DBLBUF
+    return usb_dblbuf_read(EP_MIDI_I, buf, len);
+#else
+    return usbd_ep_read_packet(usbd_dev, EP_MIDI_I, buf, len);
+#endif
+}
+
+/* Interrupts must be masked for both */
+static void usb_out_nak_set(uint8_t why){
+    if(usb_out_nak==0){
+        usbd_ep_nak_set(usb, EP_MIDI_I, 1);
+        TRACE_PKT(TR_USB_OUT_NAK, why, 1);
+    }
+    usb_out_nak|=why;
+    usb_out_nak_late=0;
+}
+
+/*
+ * STAT_RX=VALID lets the host write the packet buffer. A packet whose
+ * CTR_RX is still pending has not been read yet and would be overwritten
+ * single buffered, so then the NAK stays until usbmidi_data_rx_cb has
+ * read it.
+ */
+static void usb_out_nak_clear(uint8_t why){
+    if((usb_out_nak&why)==0)
+        return;
+    usb_out_nak&=~why;
+    if(usb_out_nak==0){
+        if(usb_ep_out_pending(EP_MIDI_I))
+            usb_out_nak_late=1;
+        else
+            usbd_ep_nak_set(usb, EP_MIDI_I, 0);
+        TRACE_PKT(TR_USB_OUT_NAK, why, 0);
+    }
+}
+
+/* After the read: the buffer is free for the host again */
+static void usb_out_nak_read(void){
+    if(usb_out_nak_late && usb_out_nak==0)
+        usbd_ep_nak_set(usb, EP_MIDI_I, 0);
+    usb_out_nak_late=0;
+}
+
+/* Lift the pool NAK once blocks have come back, from either direction */
+static void usb_out_pool_check(void){
+    if(pkt_pool_free()>USB_OUT_HW_PENDING+USB_OUT_IN_RESERVE)
+        usb_out_nak_clear(USB_OUT_NAK_POOL);
+}
+
+/* ISR side: copy the packet into a pool block and hand it over */
 static void usbmidi_data_rx_cb(usbd_device *usbd_dev __maybe_unused, uint8_t ep __maybe_unused) {
-    //(void)ep;
-
-    char buf[64];
-    int len = usbd_ep_read_packet(usbd_dev, EP_MIDI_I, buf, 64);
-
-    /* This implementation treats any message from the host as a SysEx
-     * identity request. This works well enough providing the host
-     * packs the identify request in a single 8 byte USB message.
-     */
-    char *bp=buf;
-    if (len>=4) {
-        while(len){
-            if((bp[0]==0x07 || bp[0]==0x06) && bp[1]==0xf0){ //sysex
-                usart_send_blocking(USART1, 'M');
-                usart_send_blocking(USART1, 's');
-                while (usbd_ep_write_packet(usbd_dev, EP_MIDI_O, sysex_identity,
-                            sizeof(sysex_identity)) == 0);
-            }else{
-                xcout(bp[0]);
-                //uint8_t jack=bp[0] >> 4;
-                uint8_t cmd=bp[0]&0x0f;
-                uint8_t l=1;
-                switch(cmd){
-                    case 0x02: //SS
-                    case 0x0C: //program ch
-                    case 0x0D: //chan pressure
-                        s_write(2,bp+1,2);
-                        xcout(bp[1]);
-                        xcout(bp[2]);
-                        s_write(1," ",1);
-                        break;
-                    case 0x0f: //single byte
-                        s_write(2,bp+1,1);
-                        xcout(bp[1]);
-                        s_write(1," ",1);
-                        break;
-                    case 0x04: //3+bytes
-                    case 0x07: //3bytes
-                        l++;
-                    case 0x06: //2bytes
-                        l++;
-                    case 0x05: //1byte
-                        {
-                            s_write(2,bp+1,l);
-                            xcout(bp[1]);
-                            if(l>1)
-                                xcout(bp[2]);
-                            if(l>2)
-                                xcout(bp[3]);
-                            xcout(l);
-                            s_write(1,"_",1);
-                            /*
-                            //SysEx
-                            s_write(1,"\r\nSysEx: ",9);
-                            int i=0;
-                            for(;i<l;i++){
-                                xcout(bp[i]);
-                            }
-                            s_write(1,"\r\n",2);
-                            */
-                        }
-                        break;
-                    default:
-                        s_write(2,bp+1,3);
-                        xcout(bp[1]);
-                        xcout(bp[2]);
-                        xcout(bp[3]);
-                        xcout(l);
-                        s_write(1,"-",1);
-                        //split_midi(bp, 4, 0, display_midi);
-                }
-                /*
-                   u_write(2,buf,len);
-                   u_write(1,"\r\nC: ",5);
-                   int i=0;
-                   for(;i<len;i++){
-                   xcout(buf[i]);
-                   if(i%4==3)
-                   u_write(1," ",1);
-                   }
-                   cont=(len==64);
-                   */
+    struct pkt *p=pkt_alloc();
+    if(p==NULL){
+        /* Not supposed to happen with the NAK below, clear CTR anyway */
+        usb_midi_read(usbd_dev, NULL, 0);
+        usb_out_nak_read();
+        usb_out_lost++;
+        TRACE_ERR(TR_USB_OUT_LOST, 0, usb_out_lost);
+        return;
+    }
+    if(pkt_pool_free()<=USB_OUT_HW_PENDING+USB_OUT_IN_RESERVE)
+        usb_out_nak_set(USB_OUT_NAK_POOL);
+    p->len=usb_midi_read(usbd_dev, p->data, PKT_SIZE);
+    usb_out_nak_read();
+    CAPTURE(CAP_TAG(0, 0), p->data, p->len);
+    atomQueuePut(&usb_out_queue, -1, (uint8_t*)&p);
+}
+
+/*
+ * MIDI bytes of one packet sorted by destination port, so each port gets
+ * a single uart_write; indexed like midi_port_uart. Only usb_out_thread
+ * uses them.
+ */
+static uint8_t usb_out_span[MIDI_PORT_COUNT][PKT_SIZE/4*3];
+static uint8_t usb_out_span_len[MIDI_PORT_COUNT];
+
+/*
+ * Sleep until the port's ring takes len bytes, thread context only. With
+ * nak the host is NAKed meanwhile; uart_tx_done lifts it and wakes the
+ * waiters once the DMA has made room, a waiter still short registers
+ * again.
+ */
+static void uart_wait_room(struct uart_tx *tx, uint16_t len, uint8_t nak){
+    CRITICAL_STORE;
+    CRITICAL_START();
+    while(ring_free(&tx->ring)<len){
+        if(tx->want==0 || len<tx->want)
+            tx->want=len;
+        tx->want_nak|=nak;
+        if(nak)
+            usb_out_nak_set(nak);
+        tx->waiters++;
+        CRITICAL_END();
+        atomSemGet(&tx->room, 0);
+        CRITICAL_START();
+    }
+    CRITICAL_END();
+}
+
+static void sysex_identity_reply(uint8_t cable){
+    struct midi_parser mp={ .cable=cable };
+    uint32_t ev[(sizeof(sysex_identity)+2)/3];
+    uint16_t n;
+    TRACE_PKT(TR_SYSEX_ID, cable, 0);
+    midi_parse(&mp, sysex_identity, sizeof(sysex_identity), ev,
+            sizeof(ev)/sizeof(ev[0]), &n);
+    usb_in_submit(ev, n*4);
+}
+
+/*
+ * Events go to the UART ports routed for their cable. SysEx is passed on
+ * as it streams in; an identity request is answered once its 0xf7 is
+ * seen.
+ */
+static void usb_out_decode(const uint8_t *buf, int len){
+    CRITICAL_STORE;
+    uint8_t route[16];
+    const uint8_t *bp=buf;
+    TRACE_PKT(TR_USB_OUT_PKT, len, 0);
+
+    CRITICAL_START();
+    memcpy(route, usb_out_route, sizeof(route));
+    CRITICAL_END();
+
+    for(;len>=4;len-=4,bp+=4){
+#if TRACE_LEVEL >= 3
+        uint32_t ev;
+        memcpy(&ev, bp, 4);
+        TRACE_EVT(TR_USB_OUT_EVENT, 0, ev);
+#endif
+        uint8_t cable=bp[0]>>4;
+        uint8_t l=midi_cin_bytes(bp[0]);
+        uint8_t mask=route[cable];
+        if(cable<MIDI_PORT_COUNT &&
+                sysex_feed(&usb_out_sysex[cable], &sysex_stats_out, bp+1, l,
+                    atomTimeGet())==SYSEX_IDENTITY_REQUEST)
+            sysex_identity_reply(cable);
+        for(uint8_t port=0;l && port<MIDI_PORT_COUNT;port++){
+            if(mask&ROUTE_PORT(midi_port_uart[port])){
+                memcpy(usb_out_span[port]+usb_out_span_len[port], bp+1, l);
+                usb_out_span_len[port]+=l;
             }
-            len-=4;
-            bp+=4;
         }
-        s_write(1,"*\r\n",3);
     }
 
+    for(uint8_t port=0;port<MIDI_PORT_COUNT;port++){
+        if(usb_out_span_len[port]){
+            uint8_t uart=midi_port_uart[port];
+            uart_wait_room(uart_tx_port(uart), usb_out_span_len[port],
+                    USB_OUT_NAK_UART);
+            uart_write(uart, usb_out_span[port], usb_out_span_len[port],
+                    UART_WRITE_ALL);
+            CAPTURE(CAP_TAG(uart, 1), usb_out_span[port], usb_out_span_len[port]);
+            usb_out_span_len[port]=0;
+        }
+    }
+}
+
+/* Thread side: decode, return the block */
+static void usb_out_thread(uint32_t args __maybe_unused) {
+    CRITICAL_STORE;
+    struct pkt *p;
+    while(1){
+        if(atomQueueGet(&usb_out_queue, 0, (uint8_t*)&p) != ATOM_OK)
+            continue;
+        usb_out_decode(p->data, p->len);
+        pkt_free(p);
+        CRITICAL_START();
+        usb_out_pool_check();
+        CRITICAL_END();
+    }
+}
+
+static int hexval(uint8_t c){
+    if(c>='0' && c<='9')
+        return c-'0';
+    if(c>='a' && c<='f')
+        return c-'a'+10;
+    if(c>='A' && c<='F')
+        return c-'A'+10;
+    return -1;
+}
+
+/* "R<cable><mask>": route USB OUT cable to the UART ports in mask */
+static int cdc_route_cmd(const uint8_t *cmd, int len){
+    if(len<3 || cmd[0]!='R')
+        return 0;
+    int cable=hexval(cmd[1]);
+    int mask=hexval(cmd[2]);
+    if(len>3 && mask>=0 && hexval(cmd[3])>=0)
+        mask=mask<<4|hexval(cmd[3]);
+    if(cable<0 || mask<0 || (mask&~ROUTE_MIDI_PORTS))
+        return 0;
+    usb_out_route[cable]=mask; //a single byte store, no lock needed
+    return 1;
+}
+
+#if CAPTURE_SIZE > 0
+/*
+ * Capture dump out of the CDC data endpoint, a packet per TX complete;
+ * cdc_dump_off counts what has gone out.
+ */
+static uint8_t cdc_dumping;
+static uint32_t cdc_dump_off;
+
+static void cdc_dump_next(usbd_device *usbd_dev){
+    uint8_t buf[CDC_PKT_SIZE];
+    uint16_t n=capture_read(cdc_dump_off, buf, sizeof(buf));
+    if(n==0){
+        cdc_dumping=0;
+        return;
+    }
+    if(usbd_ep_write_packet(usbd_dev, EP_CDC0_T, buf, n))
+        cdc_dump_off+=n;
+}
+
+/* "C1" starts a capture, "C0" stops it, "CD" stops and dumps it */
+static int cdc_capture_cmd(usbd_device *usbd_dev, const uint8_t *cmd, int len){
+    if(len<2 || cmd[0]!='C')
+        return 0;
+    switch(cmd[1]){
+        case '1':
+            capture_start();
+            return 1;
+        case '0':
+            capture_stop();
+            return 1;
+        case 'D':
+            capture_stop();
+            cdc_dumping=1;
+            cdc_dump_off=0;
+            cdc_dump_next(usbd_dev);
+            return 1;
+    }
+    return 0;
+}
+#endif
+
+static void cdcacm_data_tx_cb(usbd_device *usbd_dev __maybe_unused, uint8_t ep __maybe_unused)
+{
+#if CAPTURE_SIZE > 0
+    if(cdc_dumping)
+        cdc_dump_next(usbd_dev);
+#endif
 }
 
 static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
     (void)ep;
 
-    uint8_t buf[64];
-    int len = usbd_ep_read_packet(usbd_dev, EP_CDC0_R, buf, 64);
-
-    if (len) {
-        uint8_t sb1[32]={
-            0x04, 0xF0, 0x41, 0x00, 
-            0x04, 0x00, 0x15, 0x12, 
-            0x04, 0x01, 0x00, 0x00,
-            0x04, 0x42, 0x41, 0x53,
-            0x04, 0x49, 0x43, 0x20, 
-            0x04, 0x4D, 0x49, 0x58,
-            0x04, 0x20, 0x41, 0x75,
-            0x04, 0x42, 0x73, 0x44, 
-        };
-        uint8_t sb2[32]={
-            0x04, 0x61, 0x44, 0x62,
-            0x04, 0x20, 0x20, 0x53, 
-            0x04, 0x64, 0x33, 0x34, 
-            0x04, 0x4D, 0x78, 0x4D, 
-            0x04, 0x78, 0x20, 0x20, 
-            0x04, 0x00, 0x01, 0x02, 
-            0x04, 0x03, 0x04, 0x05, 
-            0x04, 0x06, 0x07, 0x08,
-        };
-        uint16_t sb3[]={ 
-            0x04, 0x09, 0x0A, 0x0B, 
-            0x04, 0x0C, 0x0D, 0x0E, 
-            0x04, 0x0F, 0x10, 0x11, 
-            0x04, 0x12, 0x13, 0x00,
-            0x04, 0x00, 0x20, 0x01,
-            0x04, 0x12, 0x12, 0x04, 
-            0x04, 0x04, 0x08, 0x08,
-            0x04, 0x01, 0x1E, 0x00,  
-        };
-        uint16_t sb4[]={
-            0x04, 0x15, 0x00, 0x00, 
-            0x06, 0x42, 0xF7, 0x00
-        };
-        usbd_ep_write_packet(usbd_dev, EP_MIDI_O, sb1, sizeof(sb1));
-        usbd_ep_write_packet(usbd_dev, EP_MIDI_O, sb2, sizeof(sb2));
-        usbd_ep_write_packet(usbd_dev, EP_MIDI_O, sb3, sizeof(sb3));
-        usbd_ep_write_packet(usbd_dev, EP_MIDI_O, sb4, sizeof(sb4));
-        buf[len] = 0;
+    struct pkt *p=pkt_alloc();
+    if(p==NULL){
+        usbd_ep_read_packet(usbd_dev, EP_CDC0_R, NULL, 0);
+        return;
     }
+    int len = usbd_ep_read_packet(usbd_dev, EP_CDC0_R, p->data, PKT_SIZE);
+
+    if (cdc_route_cmd(p->data, len))
+        u_write(1,(uint8_t*)"R\r\n",3);
+#if CAPTURE_SIZE > 0
+    if (cdc_capture_cmd(usbd_dev, p->data, len))
+        u_write(1,(uint8_t*)"C\r\n",3);
+#endif
 
     uint8_t x='S';
-    atomQueuePut(&uart1_tx,0, &x);
-    u_write(1,buf,len);
+    u_write(1,&x,1);
+    u_write(1,p->data,len);
+    pkt_free(p);
 }
 
 static int cdcacm_control_request(usbd_device *usbd_dev, struct usb_setup_data *req, uint8_t **buf,
@@ -320,10 +849,16 @@ static void usb_set_config(usbd_device *usbd_dev, uint16_t wValue) {
     usbd_ep_setup(usbd_dev, EP_MIDI_I, USB_ENDPOINT_ATTR_BULK, 64, usbmidi_data_rx_cb);
     usbd_ep_setup(usbd_dev, EP_MIDI_O, USB_ENDPOINT_ATTR_BULK, 64, usbmidi_data_tx_cb);
 
-    usbd_ep_setup(usbd_dev, EP_CDC0_R, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-    usbd_ep_setup(usbd_dev, EP_CDC0_T, USB_ENDPOINT_ATTR_BULK, 64, NULL);
+    usbd_ep_setup(usbd_dev, EP_CDC0_R, USB_ENDPOINT_ATTR_BULK, CDC_PKT_SIZE, cdcacm_data_rx_cb);
+    usbd_ep_setup(usbd_dev, EP_CDC0_T, USB_ENDPOINT_ATTR_BULK, CDC_PKT_SIZE, cdcacm_data_tx_cb);
     usbd_ep_setup(usbd_dev, EP_CDC0_I, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
+#if USB_MIDI_DBLBUF
+    usb_dblbuf_setup_out(EP_MIDI_I, PMA_MIDI_I_BUF0);
+    usb_dblbuf_setup_in(EP_MIDI_O, PMA_MIDI_O_BUF1);
+#endif
+    usb_in_reset();
+
     usbd_register_control_callback(
             usbd_dev,
             USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
@@ -332,7 +867,7 @@ static void usb_set_config(usbd_device *usbd_dev, uint16_t wValue) {
 }
 
 
-static void button_send_event(usbd_device *usbd_dev, int pressed)
+static void button_send_event(usbd_device *usbd_dev __maybe_unused, int pressed)
 {
     char buf[4] = { 0x08, /* USB framing: virtual cable 0, note on */
         0x88, /* MIDI command: note on, channel 1 */
@@ -343,44 +878,39 @@ static void button_send_event(usbd_device *usbd_dev, int pressed)
 
     buf[0] = 0x09;
     buf[1] = 0x90;
-    while (usbd_ep_write_packet(usbd_dev, EP_MIDI_O, buf, sizeof(buf)) == 0);
+    usb_in_submit(buf, sizeof(buf));
 
     buf[0] = 0x08;
     buf[1] = 0x80;
-    while (usbd_ep_write_packet(usbd_dev, EP_MIDI_O, buf, sizeof(buf)) == 0);
+    usb_in_submit(buf, sizeof(buf));
 
 }
 
-static void button_poll(usbd_device *usbd_dev)
-{
-    static uint32_t button_state = 0;
-
-    /* This is a simple shift based debounce. It's simplistic because
-     * although this implements debounce adequately it does not have any
-     * noise suppression. It is also very wide (32-bits) because it can
-     * be polled in a very tight loop (no debounce timer).
-     */
-    uint32_t old_button_state = button_state;
-    button_state = (button_state << 1) | (GPIOC_IDR & 2);
-    if ((0 == button_state) != (0 == old_button_state)) {
-        usart_send_blocking(USART1, '.');
-        /*
-           usart_send_blocking(USART1, 'p');
-           usart_send_blocking(USART1, 'r');
-           usart_send_blocking(USART1, 'e');
-           usart_send_blocking(USART1, 'v');
-           usart_send_blocking(USART1, 'e');
-           usart_send_blocking(USART1, 'd');
-           usart_send_blocking(USART1, '\r');
-           usart_send_blocking(USART1, '\n');
-           */
-        button_send_event(usbd_dev, !!button_state);
+/*
+ * Button on PC1, interrupt on both edges. The first edge of a bounce
+ * gives the new level, edges within BUTTON_DEBOUNCE_TICKS of it are
+ * contact bounce.
+ */
+#ifndef BUTTON_DEBOUNCE_TICKS
+#define BUTTON_DEBOUNCE_TICKS ((10*SYSTEM_TICKS_PER_SEC+999)/1000)
+#endif
+static uint8_t button_level;
+
+void exti1_isr(void) {
+    static uint32_t last;
+    atomIntEnter();
+    exti_reset_request(EXTI1);
+    uint8_t level=gpio_get(GPIOC, GPIO1)!=0;
+    uint32_t now=atomTimeGet();
+    if(level!=button_level && now-last>=BUTTON_DEBOUNCE_TICKS){
+        button_level=level;
+        last=now;
+        u_write(1, (uint8_t*)".", 1);
+        button_send_event(usb, level);
     }
+    atomIntExit(0);
 }
 
-
-
-
 void usart1_isr(void) {
     static uint8_t data = 'A';
     atomIntEnter();
@@ -400,251 +930,241 @@ void usart1_isr(void) {
         }
 
     }
+    atomIntExit(0);
+}
 
-    /* Check if we were called because of TXE. */
-    if (((USART_CR1(USART1) & USART_CR1_TXEIE) != 0) &&
-            ((USART_SR(USART1) & USART_SR_TXE) != 0)) {
-        uint8_t status = atomQueueGet(&uart1_tx, 0, &data);
-        if(status == ATOM_OK){
-            usart_send_blocking(USART1, data);
-        }else{
-            USART_CR1(USART1) &= ~USART_CR1_TXEIE;
-        }
+/*
+ * Start DMA on the next contiguous run of the ring unless a transfer is
+ * already going. Caller must not be preemptible by the channel's ISR.
+ */
+static void uart_tx_kick(struct uart_tx *tx){
+    if(tx->busy)
+        return;
+    uint8_t *p;
+    uint16_t run=ring_peek(&tx->ring, &p);
+    if(run==0)
+        return;
+    tx->busy=run;
+    dma_disable_channel(DMA1, tx->channel);
+    dma_set_memory_address(DMA1, tx->channel, (uint32_t)p);
+    dma_set_number_of_data(DMA1, tx->channel, run);
+    dma_enable_channel(DMA1, tx->channel);
+}
+
+static void uart_tx_done(struct uart_tx *tx){
+    dma_clear_interrupt_flags(DMA1, tx->channel, DMA_TCIF);
+    ring_consume(&tx->ring, tx->busy);
+    tx->busy=0;
+    uart_tx_kick(tx);
+    if(tx->want && ring_free(&tx->ring)>=tx->want){
+        tx->want=0;
+        usb_out_nak_clear(tx->want_nak);
+        tx->want_nak=0;
+        for(;tx->waiters;tx->waiters--)
+            atomSemPut(&tx->room);
     }
-    atomIntExit(0);
 }
 
-inline int midilen(uint8_t i);
-inline int midilen(uint8_t i){
-    switch(i&0xf0){
-        case 0x80: //Note off
-            return 3;
-        case 0x90: //Note on
-            return 3;
-        case 0xa0: //Poly aftertouch
-            return 3;
-        case 0xb0: //CC
-            return 3;
-        case 0xc0: //Program
-            return 2;
-        case 0xd0: //Chan aftertouch
-            return 2;
-        case 0xe0: //Pitch wheel
-            return 3;
-        case 0xf0:
-            switch(i){
-                case 0xf0: //sysex start
-                    return 0xff;
-
-                case 0xf1: //Quarter frame MTC
-                    return 2;
-                case 0xf2: //Song pointer
-                    return 3;
-                case 0xf3: //Song select
-                    return 2;
-                case 0xf6: //Tune request
-                    return 1;
-
-                case 0xf7: //sysex stop
-                    return 0;
-
-                case 0xf8: //timing clock
-                    return 1;
-                case 0xfa: //start
-                    return 1;
-                case 0xfb: //continue
-                    return 1;
-                case 0xfc: //stop
-                    return 1;
-                case 0xfe: //active sense;
-                    return 1;
-                case 0xff: //reset;
-                    return 1;
-            }
-    };
-    return -1;
-};
+static struct uart_tx *uart_tx_port(int file){
+    switch(file){
+#define MIDI_PORT_TX_CASE(cable, n, tx_size, rx_size, rx_dma) \
+        case n: \
+            return &uart##n##_tx;
+        case 1: //MIDI1/DEBUG
+            return &uart1_tx;
+        MIDI_PORTS(MIDI_PORT_TX_CASE)
+    }
+    return NULL;
+}
 
+void DMA_CH_ISR(UART1_TX_DMA)(void) {
+    atomIntEnter();
+    uart_tx_done(&uart1_tx);
+    atomIntExit(0);
+}
 
+#define MIDI_PORT_TX_ISR(cable, n, tx_size, rx_size, rx_dma) \
+void DMA_CH_ISR(UART##n##_TX_DMA)(void) { \
+    atomIntEnter(); \
+    uart_tx_done(&uart##n##_tx); \
+    atomIntExit(0); \
+}
 
-void process_midi_uart(uint8_t data, struct midi_uart *mi){
-    /*
-       u_write(1,(uint8_t*) ">", 1);
-       xcout(data);
-       u_write(1,(uint8_t*) "<", 1);
-       */
-    uint8_t done=0;
-    if(mi->rp==0 || ((data&0x80) == 0x80)){
-        if(data==0xf0){
-            mi->recv.u8[0]=0x04;
-            mi->recv.u8[1]=data;
-            mi->expected=4;
-            mi->rp=2;
-            mi->sysex=1;
-        }else if(data==0xf7 && mi->sysex){
-            if(mi->rp==2){
-                mi->recv.u8[0]=0x05;
-                mi->expected=2;
-            }
-            if(mi->rp==3){
-                mi->recv.u8[0]=0x06;
-                mi->expected=3;
-            }
-            if(mi->rp==4){
-                mi->recv.u8[0]=0x07;
-                mi->expected=4;
+MIDI_PORTS(MIDI_PORT_TX_ISR)
+
+/*
+ * Parse a run of received bytes straight into the USB IN packet. Events
+ * that find no room (pool and transmit queue exhausted) are dropped, the
+ * parser still sees every byte so it stays in sync.
+ * last is when the final byte arrived; the ones before it are taken to
+ * have come back to back, the latest they can have arrived at.
+ */
+void process_midi_span(const uint8_t *data, uint16_t len, tstamp_t last,
+        struct midi_uart *mi){
+    CRITICAL_STORE;
+    uint32_t now=atomTimeGet();
+    uint32_t byte_time=tstamp_midi_byte();
+    tstamp_t t=last-(len-1)*byte_time;
+    CAPTURE(CAP_TAG(mi->uart_id, 0), data, len);
+    while(len){
+        uint32_t *slot, *stamp;
+        uint32_t drop[4], drop_stamp[4];
+        uint16_t n;
+        CRITICAL_START();
+        uint8_t room=usb_in_reserve(&slot, &stamp);
+        CRITICAL_END();
+        if(room==0){
+            slot=drop;
+            stamp=drop_stamp;
+            room=sizeof(drop)/sizeof(drop[0]);
+        }
+        uint16_t used=midi_parse_stamped(&mi->parser, data, len, t, byte_time,
+                slot, stamp, room, &n);
+        data+=used;
+        len-=used;
+        t+=used*byte_time;
+        for(uint16_t i=0;i<n;i++){
+            const uint8_t *ev=(const uint8_t*)&slot[i];
+            uint8_t cin=ev[0]&0x0f;
+            sysex_feed(&mi->sysex, &sysex_stats_in, ev+1, midi_cin_bytes(cin), now);
+            if(slot==drop){
+                if(cin>=0x4 && cin<=0x7)
+                    sysex_stats_in.dropped++;
+                TRACE_ERR(TR_MIDI_DROP, mi->uart_id, drop[i]);
+            }else{
+                TRACE_EVT(TR_MIDI_EVENT, mi->uart_id, slot[i]);
             }
-            done=2;
-            mi->sysex=0;
-        }else{
-            mi->sysex=0;
-            mi->expected=midilen(data);
-            mi->recv.u8[0]=(data>>4)&0x0f;
-            mi->recv.u8[1]=data;
-            mi->rp=2;
-            if(mi->expected==1){
-                mi->recv.u8[2]=0;
-                mi->recv.u8[3]=0;
-                done=1;
-            }else if(mi->expected==2)
-                mi->recv.u8[3]=0;
-            mi->expected++; //adjust with USB header
         }
-    }else if(mi->rp<mi->expected){
-        mi->recv.u8[mi->rp]=data;
-        mi->rp++;
-        if(mi->rp>=mi->expected){
-            if(mi->sysex)
-                mi->rp=1;
-            else
-                mi->rp=2;
-            done=1;
+        if(slot!=drop){
+            CRITICAL_START();
+            usb_in_commit(n);
+            CRITICAL_END();
         }
-    }else{
-        mi->rp=0;
     }
-    if(done){
-        /*
-        xcout(mi->recv.u8[0]);
-        xcout(mi->recv.u8[1]);
-        if(mi->expected>2)
-            xcout(mi->recv.u8[2]);
-        if(mi->expected>3)
-            xcout(mi->recv.u8[3]);
-        u_write(1,(uint8_t*) "\r\n", 2);
-        */
-        mi->recv.u8[0]|=(mi->uart_id<<8);
-        atomQueuePut(&midi_input,-1, (uint8_t*) &mi->recv.u32);
-    }
-
-}
-
-void usart2_isr(void) {
-    static struct midi_uart mi={
-        .uart_id=2,
-        .recv.u32=0,
-        .rp=0,
-        .expected=0,
-        .sysex=0
-    };
-    atomIntEnter();
+    CRITICAL_START();
+    usb_in_poke();
+    CRITICAL_END();
+}
 
-    uint8_t data = 'A';
-    if (((USART_CR1(USART2) & USART_CR1_RXNEIE) != 0) &&
-            ((USART_SR(USART2) & USART_SR_RXNE) != 0)) {
-        data = usart_recv(USART2);
-        gpio_toggle(GPIOC, GPIO9);
-        process_midi_uart(data, &mi);
+/*
+ * Feed everything DMA has written since the previous call to the parser,
+ * at most two contiguous spans when the write position has wrapped.
+ * remaining is the channel's CNDTR as read by the caller.
+ */
+void dma_rx_drain(struct dma_rx *rx, uint16_t remaining, struct midi_uart *mi){
+    tstamp_t now=tstamp_now();
+    uint16_t head=rx->size-remaining;
+    if(head>=rx->size) //CNDTR reads 0 right before reload
+        head=0;
+    if(head<rx->tail){
+        process_midi_span(rx->buf+rx->tail, rx->size-rx->tail,
+                now-head*tstamp_midi_byte(), mi);
+        rx->tail=0;
     }
-
-    /* Check if we were called because of TXE. */
-    if (((USART_CR1(USART2) & USART_CR1_TXEIE) != 0) &&
-            ((USART_SR(USART2) & USART_SR_TXE) != 0)) {
-        uint8_t status = atomQueueGet(&uart2_tx, 0, &data);
-        if(status == ATOM_OK){
-            usart_send_blocking(USART2, data);
-        }else{
-            USART_CR1(USART2) &= ~USART_CR1_TXEIE;
-        }
+    if(head>rx->tail){
+        process_midi_span(rx->buf+rx->tail, head-rx->tail, now, mi);
+        rx->tail=head;
     }
-    atomIntExit(0);
 }
 
-void usart3_isr(void) {
-    static struct midi_uart mi={
-        .uart_id=3,
-        .recv.u32=0,
-        .rp=0,
-        .expected=0,
-        .sysex=0
-    };
-    atomIntEnter();
+/*
+ * Receive interrupts: on a DMA port the half/full transfer and the USART
+ * idle line both drain the DMA buffer, on the others every byte raises
+ * RXNE.
+ */
+#define MIDI_PORT_RX_ISR_1(n) \
+void DMA_CH_ISR(UART##n##_RX_DMA)(void) { \
+    atomIntEnter(); \
+    dma_clear_interrupt_flags(DMA1, DMA_CH(UART##n##_RX_DMA), DMA_HTIF|DMA_TCIF); \
+    gpio_toggle(GPIOC, UART##n##_LED); \
+    dma_rx_drain(&uart##n##_rx_dma, \
+            DMA_CNDTR(DMA1, DMA_CH(UART##n##_RX_DMA)), &midi_uart##n); \
+    atomIntExit(0); \
+} \
+\
+void usart##n##_isr(void) { \
+    atomIntEnter(); \
+    if (((USART_CR1(UART##n##_USART) & USART_CR1_IDLEIE) != 0) && \
+            ((USART_SR(UART##n##_USART) & USART_SR_IDLE) != 0)) { \
+        (void)USART_DR(UART##n##_USART); /* SR then DR read clears IDLE */ \
+        gpio_toggle(GPIOC, UART##n##_LED); \
+        dma_rx_drain(&uart##n##_rx_dma, \
+                DMA_CNDTR(DMA1, DMA_CH(UART##n##_RX_DMA)), &midi_uart##n); \
+    } \
+    atomIntExit(0); \
+}
+#define MIDI_PORT_RX_ISR_0(n) \
+void usart##n##_isr(void) { \
+    atomIntEnter(); \
+    if (((USART_CR1(UART##n##_USART) & USART_CR1_RXNEIE) != 0) && \
+            ((USART_SR(UART##n##_USART) & USART_SR_RXNE) != 0)) { \
+        uint8_t data = usart_recv(UART##n##_USART); \
+        gpio_toggle(GPIOC, UART##n##_LED); \
+        process_midi_span(&data, 1, tstamp_now(), &midi_uart##n); \
+    } \
+    atomIntExit(0); \
+}
+#define MIDI_PORT_RX_ISR(cable, n, tx_size, rx_size, rx_dma) MIDI_PORT_RX_ISR_##rx_dma(n)
+
+MIDI_PORTS(MIDI_PORT_RX_ISR)
 
-    uint8_t data = 'A';
-    if (((USART_CR1(USART3) & USART_CR1_RXNEIE) != 0) &&
-            ((USART_SR(USART3) & USART_SR_RXNE) != 0)) {
-        data = usart_recv(USART3);
-        gpio_toggle(GPIOC, GPIO8);
-        process_midi_uart(data, &mi);
+/*
+ * Events are assembled by the parsers themselves, this thread only
+ * enforces the deadline of a packet held back by a busy endpoint.
+ */
+static void master_thread(uint32_t args __maybe_unused) {
+    CRITICAL_STORE;
+    while(1){
+        CRITICAL_START();
+        int32_t timeout=usb_in_poke(); //0 waits for the next packet
+        CRITICAL_END();
+        if(atomSemGet(&usb_in_sem, timeout)!=ATOM_OK)
+            continue;
+        uint32_t cycles=dwt_read_cycle_counter()-usb_in_sem_cycle;
+        usb_in_stats.wakes++;
+        usb_in_stats.wake_total_cycles+=cycles;
+        if(cycles>usb_in_stats.wake_max_cycles)
+            usb_in_stats.wake_max_cycles=cycles;
     }
+}
 
-    /* Check if we were called because of TXE. */
-    if (((USART_CR1(USART3) & USART_CR1_TXEIE) != 0) &&
-            ((USART_SR(USART3) & USART_SR_TXE) != 0)) {
-        uint8_t status = atomQueueGet(&uart3_tx, 0, &data);
-        if(status == ATOM_OK){
-            usart_send_blocking(USART3, data);
-        }else{
-            USART_CR1(USART3) &= ~USART_CR1_TXEIE;
-        }
+/*
+ * Ticks the CPU may sleep through: the kernel timer of master_thread's
+ * deadline wait, 0 - none. It is the only timed wait in the firmware,
+ * everything else sleeps on a semaphore until an ISR has work for it.
+ */
+static uint32_t idle_ticks(void){
+    if(usb_in_fill==0)
+        return 0;
+    return usb_in_deadline_ticks();
+}
+
+/* Runs whenever nothing else can, above the kernel's spinning idle */
+static void sleep_thread(uint32_t args __maybe_unused) {
+    CRITICAL_STORE;
+    while(1){
+        CRITICAL_START();
+        idle_sleep(idle_ticks());
+        CRITICAL_END();
     }
-    atomIntExit(0);
 }
 
-static void master_thread(uint32_t args __maybe_unused) {
-    uint8_t sendbuf[64];
+#if TRACE_LEVEL > 0
+/*
+ * Lowest priority above idle: ships trace records out of USART1 while
+ * its ring has room, so tracing never competes with MIDI traffic.
+ */
+static void trace_thread(uint32_t args __maybe_unused) {
+    struct trace_rec rec;
+    uint8_t frame[TRACE_FRAME_SIZE];
     while(1){
-        uint8_t status = atomQueueGet(&midi_input, 0, (void*)&(sendbuf[0]));
-        //atomTimerDelay(SYSTEM_TICKS_PER_SEC);
-        atomTimerDelay(1);
-        //usbd_ep_write_packet(usb, EP_CDC0_T, buf, 1);
-        /*
-        xcout(status);
-        */
-        if(status == ATOM_OK){
-            s_write(1,".",1);
-            uint8_t sbp=0;
-            goto t1;
-            while((sbp+=4)<60){
-                status = atomQueueGet(&midi_input, -1, (void*)&(sendbuf[sbp]));
-                if(status != ATOM_OK){
-                    break;
-                };
-                s_write(1,"+",1);
-t1:
-                if((sendbuf[sbp]&0x0f)==0x05 ||
-                        (sendbuf[sbp]&0x0f)==0x06 ||
-                        (sendbuf[sbp]&0x0f)==0x07){
-                    s_write(1,"T",1);
-                    sendbuf[sbp+4]=(sendbuf[sbp]&0xf0) | 0x0f;
-                    sbp+=4;
-                    sendbuf[sbp+1]=0xfe;
-                    sendbuf[sbp+2]=0;
-                    sendbuf[sbp+3]=0;
-                }
-            }
-            xcout(sbp);
-            int i=0;
-            s_write(1,":",1);
-            for(i=0;i<sbp;i++){
-                xcout(sendbuf[i]);
-            }
-            usbd_ep_write_packet(usb, EP_MIDI_O, sendbuf, sbp);
-            s_write(1,"\r\n",2);
-        }
-        //usbd_poll(usb);
+        trace_wait(&rec);
+        trace_frame(frame, &rec);
+        uart_wait_room(&uart1_tx, sizeof(frame), 0);
+        uart_write(1, frame, sizeof(frame), UART_WRITE_ALL);
     }
 }
+#endif
 
 void usb_wakeup_isr(void) {
     atomIntEnter();
@@ -667,19 +1187,32 @@ int main(void) {
         rcc_periph_clock_enable(RCC_GPIOC);
         rcc_periph_clock_enable(RCC_AFIO);
         rcc_periph_clock_enable(RCC_USART1);
-        rcc_periph_clock_enable(RCC_USART2);
-        rcc_periph_clock_enable(RCC_USART3);
+#define MIDI_PORT_RCC(cable, n, tx_size, rx_size, rx_dma) \
+        rcc_periph_clock_enable(UART##n##_RCC);
+        MIDI_PORTS(MIDI_PORT_RCC)
+        rcc_periph_clock_enable(RCC_DMA1);
 
         AFIO_MAPR |= AFIO_MAPR_SWJ_CFG_JTAG_OFF_SW_ON;
 
         gpio_set_mode(GPIOA, GPIO_MODE_INPUT, 0, GPIO15);
 
         usart_setup();
+#define MIDI_PORT_RX_DMA_SETUP_1(n) \
+        usart_rx_dma_setup(UART##n##_USART, DMA_CH(UART##n##_RX_DMA), \
+                DMA_CH_IRQ(UART##n##_RX_DMA), \
+                uart##n##_rx_dma_storage, sizeof(uart##n##_rx_dma_storage));
+#define MIDI_PORT_RX_DMA_SETUP_0(n)
+#define MIDI_PORT_DMA_SETUP(cable, n, tx_size, rx_size, rx_dma) \
+        MIDI_PORT_RX_DMA_SETUP_##rx_dma(n) \
+        usart_tx_dma_setup(UART##n##_USART, DMA_CH(UART##n##_TX_DMA), \
+                DMA_CH_IRQ(UART##n##_TX_DMA));
+        MIDI_PORTS(MIDI_PORT_DMA_SETUP)
+        usart_tx_dma_setup(UART1_USART, DMA_CH(UART1_TX_DMA),
+                DMA_CH_IRQ(UART1_TX_DMA));
 
         cm_mask_interrupts(true);
-        systick_set_frequency(SYSTEM_TICKS_PER_SEC, 24000000);
-        systick_interrupt_enable();
-        systick_counter_enable();
+        idle_tick_setup();
+        dwt_enable_cycle_counter();
 
 
         nvic_set_priority(NVIC_PENDSV_IRQ, 0xFF);
@@ -716,6 +1249,10 @@ int main(void) {
 
         gpio_set_mode(GPIOC, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, GPIO1);
         gpio_set(GPIOC, GPIO1);
+        exti_select_source(EXTI1, GPIOC);
+        exti_set_trigger(EXTI1, EXTI_TRIGGER_BOTH);
+        exti_enable_request(EXTI1);
+        button_level=gpio_get(GPIOC, GPIO1)!=0;
 
 
         usart_send_blocking(USART1, '\r');
@@ -734,6 +1271,7 @@ int main(void) {
 
         nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
         nvic_enable_irq(NVIC_USB_WAKEUP_IRQ);
+        nvic_enable_irq(NVIC_EXTI1_IRQ);
 
         gpio_set(GPIOA, GPIO8);
 
@@ -741,32 +1279,24 @@ int main(void) {
             fault(1);
 
 
-        if (atomQueueCreate (&uart1_rx, uart1_rx_storage, sizeof(uint8_t), 
-                    sizeof(uart1_rx_storage)) != ATOM_OK) 
-            fault(2);
-        if (atomQueueCreate (&uart1_tx, uart1_tx_storage, sizeof(uint8_t), 
-                    sizeof(uart1_tx_storage)) != ATOM_OK) 
-            fault(3);
-        /*
-        if (atomQueueCreate (&uart2_rx, uart2_rx_storage, sizeof(uint8_t), 
-                    sizeof(uart2_rx_storage)) != ATOM_OK) 
-            fault(4);
-            */
-        if (atomQueueCreate (&uart2_tx, uart2_tx_storage, sizeof(uint8_t), 
-                    sizeof(uart2_tx_storage)) != ATOM_OK) 
-            fault(5);
-        /*
-        if (atomQueueCreate (&uart3_rx, uart3_rx_storage, sizeof(uint8_t), 
-                    sizeof(uart3_rx_storage)) != ATOM_OK) 
-            fault(6);
-            */
-        if (atomQueueCreate (&uart3_tx, uart3_tx_storage, sizeof(uint8_t), 
-                    sizeof(uart3_tx_storage)) != ATOM_OK) 
-            fault(7);
-        if (atomQueueCreate (&midi_input, (uint8_t *)midi_input_storage, 
-                    sizeof(uint32_t), 
-                    sizeof(midi_input_storage)/sizeof(uint32_t)) != ATOM_OK) 
+        ring_init(&uart1_rx, uart1_rx_storage, sizeof(uart1_rx_storage));
+        pkt_pool_init();
+        if (atomQueueCreate (&usb_out_queue, (uint8_t *)usb_out_queue_storage,
+                    sizeof(struct pkt *),
+                    sizeof(usb_out_queue_storage)/sizeof(struct pkt *)) != ATOM_OK)
+            fault(10);
+        if (atomSemCreate (&usb_in_sem, 0) != ATOM_OK)
             fault(8);
+#define MIDI_PORT_ROOM_SEM(cable, n, tx_size, rx_size, rx_dma) \
+        if (atomSemCreate (&uart##n##_tx.room, 0) != ATOM_OK) \
+            fault(11);
+        MIDI_PORTS(MIDI_PORT_ROOM_SEM)
+        if (atomSemCreate (&uart1_tx.room, 0) != ATOM_OK)
+            fault(11);
+#if TRACE_LEVEL > 0
+        if (trace_init() != ATOM_OK)
+            fault(12);
+#endif
         /*
         if (atomQueueCreate (&usbmidi_send, usbmidi_send_storage, sizeof(uint8_t), sizeof(usbmidi_send_storage)) != ATOM_OK) 
             fault(9);
@@ -774,44 +1304,59 @@ int main(void) {
 
         atomThreadCreate(&master_thread_tcb, 10, master_thread, 0,
                 master_thread_stack, sizeof(master_thread_stack), TRUE);
-
-        atomOSStart();
+        atomThreadCreate(&usb_out_thread_tcb, 9, usb_out_thread, 0,
+                usb_out_thread_stack, sizeof(usb_out_thread_stack), TRUE);
+#if TRACE_LEVEL > 0
+        atomThreadCreate(&trace_thread_tcb, 250, trace_thread, 0,
+                trace_thread_stack, sizeof(trace_thread_stack), TRUE);
+#endif
+        atomThreadCreate(&sleep_thread_tcb, 254, sleep_thread, 0,
+                sleep_thread_stack, sizeof(sleep_thread_stack), TRUE);
+
+        atomOSStart(); //does not return
         while (1){
-            button_poll(usb);
         }
     }
 
-inline int s_write(int file, char *ptr, int len) {
-    return u_write(file, (uint8_t *)ptr,len);
-};
-
-int u_write(int file, uint8_t *ptr, int len) {
-    int i;
-    for (i = 0; i < len; i++){
-        switch(file){
-            case 1: //MIDI1/DEBUG
-                atomQueuePut(&uart1_tx,-1, (uint8_t*) &ptr[i]);
-                break;
-            case 2: //MIDI2
-                atomQueuePut(&uart2_tx,0, (uint8_t*) &ptr[i]);
-                break;
-            case 3: //MIDI3
-                atomQueuePut(&uart3_tx,0, (uint8_t*) &ptr[i]);
-                break;
-        }
-    }
-    switch(file){
-        case 1:
-            USART_CR1(USART1) |= USART_CR1_TXEIE;
-            break;
-        case 2:
-            USART_CR1(USART2) |= USART_CR1_TXEIE;
-            break;
-        case 3:
-            USART_CR1(USART3) |= USART_CR1_TXEIE;
+/*
+ * Rings are single producer; port 1 is written from threads and ISRs
+ * alike, so producers serialise here. Returns the number of bytes taken,
+ * which is less than len only in NONBLOCK and ALL mode (or BLOCK from an
+ * ISR).
+ */
+int uart_write(int file, const uint8_t *ptr, int len, enum uart_write_mode mode) {
+    CRITICAL_STORE;
+    struct uart_tx *tx=uart_tx_port(file);
+    int done=0;
+    if(tx==NULL || len<=0)
+        return 0;
+    if(mode==UART_WRITE_BLOCK && atomCurrentContext()==NULL)
+        mode=UART_WRITE_NONBLOCK;
+    while(1){
+        CRITICAL_START();
+        if(mode!=UART_WRITE_ALL || ring_free(&tx->ring)>=len)
+            done+=ring_write(&tx->ring, ptr+done, len-done);
+        if(done<len && mode!=UART_WRITE_BLOCK)
+            tx->dropped+=len-done;
+        uart_tx_kick(tx);
+        CRITICAL_END();
+        if(done==len || mode!=UART_WRITE_BLOCK)
             break;
+        uint16_t chunk=tx->ring.mask/2+1;
+        uart_wait_room(tx, len-done<chunk?len-done:chunk, 0);
     }
-    return i;
+    if(done<len)
+        TRACE_ERR(TR_UART_DROP, file, len-done);
+    return done;
+}
+
+/*
+ * Console output. Its callers are ISRs (CDC echo, button, USART1 echo),
+ * which cannot wait for the DMA: what does not fit into the ring is
+ * dropped and counted in uart1_tx.dropped.
+ */
+int u_write(int file, uint8_t *ptr, int len) {
+    return uart_write(file, ptr, len, UART_WRITE_NONBLOCK);
 }
 
 